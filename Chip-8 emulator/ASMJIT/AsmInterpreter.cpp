@@ -1,58 +1,64 @@
-#include "render.h"
 #include "../emucore.h"
 #include "../input.h"
 #include "AsmInterpreter.h"
 
+#include <map>
+#include <memory>
+#include <mutex>
+
 using namespace asmjit;
 
 #define DECLARE(...) decltype(__VA_ARGS__) __VA_ARGS__
 
+// Costs are in VIP machine cycles (8 clocks, ~4.5us), averages measured on the original interpreter
+// SCHIP-only instructions never ran on the VIP and are charged like their nearest VIP relative
 DECLARE(asm_insts::all_ops) =
 {
-	{0x0000, 0x0000, true , &asm_insts::UNK}, // Fill all the table with UNK first
-	{0xFFFF, 0x00E0, false, &asm_insts::CLS},
-	{0xFFFF, 0x00EE, true , &asm_insts::RET},
-	{0xFFFF, 0x00FA, false, &asm_insts::Compat},
-	{0xFFFF, 0x00FB, false, &asm_insts::SCR},
-	{0xFFFF, 0x00FC, false, &asm_insts::SCL},
-	{0xFFFF, 0x00FE, false, &asm_insts::RESL},
-	{0xFFFF, 0x00FF, false, &asm_insts::RESH},
-	{0xF000, 0x1000, true , &asm_insts::JP},
-	{0xF000, 0x2000, true , &asm_insts::CALL},
-	{0xF000, 0x3000, true , &asm_insts::SEi},
-	{0xF000, 0x4000, true , &asm_insts::SNEi},
-	{0xF00F, 0x5000, true , &asm_insts::SE},
-	{0xF000, 0x6000, false, &asm_insts::WRI},
-	{0xF000, 0x7000, false, &asm_insts::ADDI},
-	{0xF00F, 0x8000, false, &asm_insts::ASS},
-	{0xF00F, 0x8001, false, &asm_insts::OR},
-	{0xF00F, 0x8002, false, &asm_insts::AND},
-	{0xF00F, 0x8003, false, &asm_insts::XOR},
-	{0xF00F, 0x8004, false, &asm_insts::ADD},
-	{0xF00F, 0x8005, false, &asm_insts::SUB},
-	{0xF00F, 0x8006, false, &asm_insts::SHR},
-	{0xF00F, 0x8007, false, &asm_insts::RSB},
-	{0xF00F, 0x800E, false, &asm_insts::SHL},
-	{0xF00F, 0x9000, true , &asm_insts::SNE},
-	{0xF000, 0xA000, false, &asm_insts::SetIndex},
-	{0xF000, 0xB000, true , &asm_insts::JPr},
-	{0xF000, 0xC000, false, &asm_insts::RND},
-	{0xF000, 0xD000, false, &asm_insts::DRW},
-	{0xF00F, 0xD000, false, &asm_insts::XDRW},
-	{0xF0FF, 0xE09E, true , &asm_insts::SKP},
-	{0xF0FF, 0xE0A1, true , &asm_insts::SKNP},
-	{0xF0FF, 0xF007, false, &asm_insts::GetD},
-	{0xF0FF, 0xF00A, false, &asm_insts::GetK},
-	{0xF0FF, 0xF015, false, &asm_insts::SetD},
-	{0xF0FF, 0xF018, false, &asm_insts::SetS},
-	{0xF0FF, 0xF01E, false, &asm_insts::AddIndex},
-	{0xF0FF, 0xF029, false, &asm_insts::SetCh},
-	{0xF0FF, 0xF033, false, &asm_insts::STD},
-	{0xF0FF, 0xF055, false, &asm_insts::STR},
-	{0xF0FF, 0xF065, false, &asm_insts::LDR},
-	{0xF0FF, 0xF075, false, &asm_insts::FSAVE},
-	{0xF0FF, 0xF085, false, &asm_insts::FRESTORE},
-	{0xFFFF, 0xFFFF, true , &asm_insts::guard}
+	{0x0000, 0x0000, true , &asm_insts::UNK, 0}, // Fill all the table with UNK first
+	{0xFFF0, 0x00C0, false, &asm_insts::SCD, 24},
+	{0xFFFF, 0x00E0, false, &asm_insts::CLS, 24},
+	{0xFFFF, 0x00EE, true , &asm_insts::RET, 23},
+	{0xFFFF, 0x00FA, false, &asm_insts::Compat, 24},
+	{0xFFFF, 0x00FB, false, &asm_insts::SCR, 24},
+	{0xFFFF, 0x00FC, false, &asm_insts::SCL, 24},
+	{0xFFFF, 0x00FE, false, &asm_insts::RESL, 24},
+	{0xFFFF, 0x00FF, false, &asm_insts::RESH, 24},
+	{0xF000, 0x1000, true , &asm_insts::JP, 23},
+	{0xF000, 0x2000, true , &asm_insts::CALL, 23},
+	{0xF000, 0x3000, true , &asm_insts::SEi, 12},
+	{0xF000, 0x4000, true , &asm_insts::SNEi, 12},
+	{0xF00F, 0x5000, true , &asm_insts::SE, 16},
+	{0xF000, 0x6000, false, &asm_insts::WRI, 6},
+	{0xF000, 0x7000, false, &asm_insts::ADDI, 10},
+	{0xF00F, 0x8000, false, &asm_insts::ASS, 44},
+	{0xF00F, 0x8001, false, &asm_insts::OR, 44},
+	{0xF00F, 0x8002, false, &asm_insts::AND, 44},
+	{0xF00F, 0x8003, false, &asm_insts::XOR, 44},
+	{0xF00F, 0x8004, false, &asm_insts::ADD, 44},
+	{0xF00F, 0x8005, false, &asm_insts::SUB, 44},
+	{0xF00F, 0x8006, false, &asm_insts::SHR, 44},
+	{0xF00F, 0x8007, false, &asm_insts::RSB, 44},
+	{0xF00F, 0x800E, false, &asm_insts::SHL, 44},
+	{0xF00F, 0x9000, true , &asm_insts::SNE, 16},
+	{0xF000, 0xA000, false, &asm_insts::SetIndex, 12},
+	{0xF000, 0xB000, true , &asm_insts::JPr, 23},
+	{0xF000, 0xC000, false, &asm_insts::RND, 36},
+	{0xF000, 0xD000, false, &asm_insts::DRW, 26},
+	{0xF00F, 0xD000, false, &asm_insts::XDRW, 26},
+	{0xF0FF, 0xE09E, true , &asm_insts::SKP, 16},
+	{0xF0FF, 0xE0A1, true , &asm_insts::SKNP, 16},
+	{0xF0FF, 0xF007, false, &asm_insts::GetD, 10},
+	{0xF0FF, 0xF00A, false, &asm_insts::GetK, 10},
+	{0xF0FF, 0xF015, false, &asm_insts::SetD, 10},
+	{0xF0FF, 0xF018, false, &asm_insts::SetS, 10},
+	{0xF0FF, 0xF01E, false, &asm_insts::AddIndex, 19},
+	{0xF0FF, 0xF029, false, &asm_insts::SetCh, 20},
+	{0xF0FF, 0xF033, false, &asm_insts::STD, 204},
+	{0xF0FF, 0xF055, false, &asm_insts::STR, 14},
+	{0xF0FF, 0xF065, false, &asm_insts::LDR, 14},
+	{0xF0FF, 0xF075, false, &asm_insts::FSAVE, 14},
+	{0xF0FF, 0xF085, false, &asm_insts::FRESTORE, 14},
+	{0xFFFF, 0xFFFF, true , &asm_insts::guard, 0}
 };
 
 // Shared instruction handlers opcodes (TODO: use more opcodes?)
@@ -79,6 +85,9 @@ const std::array<X86Gp, 4> args =
 // Default return register on x86-64 Windows
 const X86Gp& retn = x86::rax;
 
+// Guest memory base (non-volatile, loaded on entry)
+const X86Gp& mem = x86::r13;
+
 // Temporaries
 //std::array<X86Gp, 7> tr = 
 //{
@@ -87,15 +96,65 @@ const X86Gp& retn = x86::rax;
 //	x86::r10,
 //	x86::r11,
 //	x86::r12, // non-volatile 
-//	x86::r13, // non-volatile
 //	x86::r14  // non-volatile
 //};
 
 // Optional code emitting after the end of the current instruction
 static std::function<void(X86Assembler&)> from_end{};
 
+// Settings of the table currently being compiled
+static asm_insts::config_t s_cfg{};
+
+// Table currently being compiled, handlers dispatch through the table of their own config
+static const asm_insts::func_t* s_table = nullptr;
+
+// Set while compiling handlers of the lazy table (VF of the last DRW is not computed yet)
+static bool s_lazy = false;
+
+// Table of the config with the index increment quirk (00FA switches to it)
+static const asm_insts::func_t* s_compat_table = nullptr;
+
+// Set by builders to end the time slice after the instruction
+static bool s_end_slice = false;
+
+// Set by builders leaving the variable part of their VIP cost in r15d (vip_timing)
+static bool s_var_cost = false;
+
+// VIP cost of each sprite row, and its extra when the sprite isn't byte aligned (bits are shifted one at a time)
+constexpr u32 VIP_ROW_CYCLES = 14;
+constexpr u32 VIP_SHIFT_CYCLES = 12;
+
+// VIP cost of each register moved by FX55/FX65
+constexpr u32 VIP_MOVE_CYCLES = 14;
+
+// Masks of the first n bytes of a 16 bytes block (FX55/FX65)
+alignas(16) static const std::array<std::array<u8, 16>, 17> s_byte_masks = []()
+{
+	std::array<std::array<u8, 16>, 17> masks{};
+
+	for (u32 n = 0; n < masks.size(); n++)
+	{
+		for (u32 i = 0; i < n; i++)
+		{
+			masks[n][i] = 0xFF;
+		}
+	}
+
+	return masks;
+}();
+
+// Compiled tables cache, guarded by the mutex (also guards the builder statics above)
+static std::mutex s_build_mutex;
+static std::map<u32, std::unique_ptr<asm_insts::func_t[]>> s_tables;
+
 #define STATE_OFFS(member) ::offset_of(&emu_state::member)
-constexpr u32 STACK_RESERVE = 0x28;
+constexpr u32 STACK_RESERVE = 0x38;
+
+// Stack slot holding the state pointer (above the callee's home space)
+constexpr u32 STATE_SLOT = 0x20;
+
+// Stack slot free for use by a single handler (not preserved across instructions)
+constexpr u32 SCRATCH_SLOT = 0x28;
 
 // Addressing helpers:
 // Get offset shift by type (size must be 1, 2, 4, or 8)
@@ -116,6 +175,178 @@ constexpr u32 STACK_RESERVE = 0x28;
 // TODO (add a setting for it)
 const bool g_sleep_supported = true;
 
+// Vector width of the selected ISA level in bytes
+static u32 vector_size()
+{
+	switch (::get_cpu_features().level)
+	{
+	case isa_level::avx512: return 64;
+	case isa_level::avx2: return 32;
+	default: return 16;
+	}
+}
+
+// Zero a vector register
+static void vector_zero(X86Assembler& c, u32 n)
+{
+	switch (::get_cpu_features().level)
+	{
+	case isa_level::avx512: c.vpxord(x86::zmm(n), x86::zmm(n), x86::zmm(n)); break;
+	case isa_level::avx2: c.vpxor(x86::ymm(n), x86::ymm(n), x86::ymm(n)); break;
+	default: c.pxor(x86::xmm(n), x86::xmm(n)); break;
+	}
+}
+
+// Unaligned vector store
+static void vector_store(X86Assembler& c, const X86Mem& dst, u32 n)
+{
+	switch (::get_cpu_features().level)
+	{
+	case isa_level::avx512: c.vmovdqu64(dst, x86::zmm(n)); break;
+	case isa_level::avx2: c.vmovdqu(dst, x86::ymm(n)); break;
+	default: c.movdqu(dst, x86::xmm(n)); break;
+	}
+}
+
+// Shift the 16 byte lines at [r9] by 4 pixels (one line per 128-bit lane)
+// Bits crossing the middle of a line move between its words if 'carry' is set
+static void vector_shift_lines(X86Assembler& c, bool is_right, bool carry)
+{
+	switch (::get_cpu_features().level)
+	{
+	case isa_level::avx512:
+	{
+		c.vmovdqu64(x86::zmm0, x86::zword_ptr(x86::r9));
+		if (carry) is_right ? c.vpslldq(x86::zmm1, x86::zmm0, 8) : c.vpsrldq(x86::zmm1, x86::zmm0, 8);
+		if (carry) is_right ? c.vpsllq(x86::zmm1, x86::zmm1, 60) : c.vpsrlq(x86::zmm1, x86::zmm1, 60);
+		is_right ? c.vpsrlq(x86::zmm0, x86::zmm0, 4) : c.vpsllq(x86::zmm0, x86::zmm0, 4);
+		if (carry) c.vporq(x86::zmm0, x86::zmm0, x86::zmm1);
+		c.vmovdqu64(x86::zword_ptr(x86::r9), x86::zmm0);
+		break;
+	}
+	case isa_level::avx2:
+	{
+		c.vmovdqu(x86::ymm0, x86::yword_ptr(x86::r9));
+		if (carry) is_right ? c.vpslldq(x86::ymm1, x86::ymm0, 8) : c.vpsrldq(x86::ymm1, x86::ymm0, 8);
+		if (carry) is_right ? c.vpsllq(x86::ymm1, x86::ymm1, 60) : c.vpsrlq(x86::ymm1, x86::ymm1, 60);
+		is_right ? c.vpsrlq(x86::ymm0, x86::ymm0, 4) : c.vpsllq(x86::ymm0, x86::ymm0, 4);
+		if (carry) c.vpor(x86::ymm0, x86::ymm0, x86::ymm1);
+		c.vmovdqu(x86::yword_ptr(x86::r9), x86::ymm0);
+		break;
+	}
+	default:
+	{
+		c.movdqu(x86::xmm0, x86::oword_ptr(x86::r9));
+		if (carry) c.movdqa(x86::xmm1, x86::xmm0);
+		if (carry) is_right ? c.pslldq(x86::xmm1, 8) : c.psrldq(x86::xmm1, 8);
+		if (carry) is_right ? c.psllq(x86::xmm1, 60) : c.psrlq(x86::xmm1, 60);
+		is_right ? c.psrlq(x86::xmm0, 4) : c.psllq(x86::xmm0, 4);
+		if (carry) c.por(x86::xmm0, x86::xmm1);
+		c.movdqu(x86::oword_ptr(x86::r9), x86::xmm0);
+		break;
+	}
+	}
+}
+
+// Clear upper vector state before calling C++ code (avoids AVX-SSE transition penalties)
+static void leave_avx(X86Assembler& c)
+{
+	if (::get_cpu_features().level >= isa_level::avx2)
+	{
+		c.vzeroupper();
+	}
+}
+
+// Jump to the handler of the opcode in 'op'
+static void dispatch(X86Assembler& c, const X86Gp& op)
+{
+	c.mov(retn, imm_ptr(s_table));
+	c.jmp(x86::qword_ptr(retn, op, GET_SHIFT(asm_insts::func_t)));
+}
+
+// Jump to the handler of a fixed opcode
+static void jump_to(X86Assembler& c, u32 opcode)
+{
+	c.mov(retn, imm_ptr(s_table + opcode));
+	c.jmp(x86::qword_ptr(retn));
+}
+
+// Reload the state pointer after calls (rcx is volatile)
+inline void restore_state(X86Assembler& c)
+{
+	c.mov(state, x86::qword_ptr(x86::rsp, STATE_SLOT));
+}
+
+// Wrapper to member function
+static void present_frame(emu_state* _state)
+{
+	_state->present();
+}
+
+// Only the lines of the draw changed
+static void present_draw(emu_state* _state)
+{
+	_state->present(_state->draw_row_mask());
+}
+
+// Wait for the next 60hz frame (display wait quirk, wall clock ticks)
+static void wait_frame(emu_state* _state)
+{
+	// The boundary of the tick after the current one, a fixed sleep would add the time already spent in the frame
+	const u64 next = _state->current_tick() + 1;
+	std::this_thread::sleep_until(_state->clock_origin + std::chrono::steady_clock::duration(std::chrono::seconds(1)) * next / 60);
+}
+
+// Wrappers to timer member functions (wall clock ticks)
+static u8 get_delay_timer(emu_state* _state)
+{
+	return _state->delay_timer();
+}
+
+static void set_delay_timer(emu_state* _state, u8 value)
+{
+	_state->set_delay(value);
+}
+
+static void set_sound_timer(emu_state* _state, u8 value)
+{
+	_state->set_sound(value);
+}
+
+// FX0A of windowed instances: park until a key is pressed and released
+static u8 wait_for_key(emu_state* _state)
+{
+	return input::WaitForPress(_state->key_state);
+}
+
+// Compute VF of the last DRW
+static void resolve_draw(emu_state* _state)
+{
+	_state->getVF() = _state->draw_result();
+}
+
+// Leave generated code through the entry function (state must be loaded)
+void exit_with(X86Assembler& c, exit_reason reason, const char* error = nullptr)
+{
+	if (s_lazy)
+	{
+		// The state must be complete outside of generated code
+		c.call(imm_ptr(&resolve_draw));
+		restore_state(c);
+	}
+
+	if (error)
+	{
+		c.mov(x86::r8, imm_ptr(error));
+		c.mov(x86::qword_ptr(state, STATE_OFFS(last_error)), x86::r8);
+	}
+
+	c.mov(x86::dword_ptr(state, STATE_OFFS(exit_code)), static_cast<u32>(reason));
+	c.mov(x86::r8, imm_ptr(&asm_insts::entry));
+	c.mov(x86::r8, x86::qword_ptr(x86::r8));
+	c.jmp(x86::r8);
+}
+
 template <u32 _index, bool is_be = false>
 void getField(X86Assembler& c, const X86Gp& reg, const X86Gp& opr = opcode)
 {
@@ -175,6 +406,7 @@ void print_inst()
 
 	static const std::initializer_list<print_inst_t> insts =
 	{
+		{0xFFF0, 0x00C0, "SCD"},
 		{0xFFFF, 0x00E0, "CLS"},
 		{0xFFFF, 0x00EE, "RET"},
 		{0xFFFF, 0x00FA, "Compat"},
@@ -276,7 +508,7 @@ void print_inst()
 
 	for (u32 i = 0; i < 5; i++)
 	{
-		(!g_state.extended ? KickChip8Framebuffer : KickSChip8Framebuffer)(&g_state.gfxMemory[0]);
+		g_state.present();
 
 		if (!paused)
 		{
@@ -308,7 +540,7 @@ asmjit::X86Mem refVF()
 };
 
 template <typename F>
-asm_insts::func_t build_instruction(const F& func, const bool jump)
+asm_insts::func_t build_instruction(const F& func, const bool jump, const u32 cycles)
 {
 	return build_function_asm<asm_insts::func_t>([&](X86Assembler& c)
 	{
@@ -319,31 +551,64 @@ asm_insts::func_t build_instruction(const F& func, const bool jump)
 			c.add(pc.r32(), 2);
 		}
 
-		if (g_sleep_supported)
+		// The virtual clock is paced by the caller
+		if (g_sleep_supported && !s_cfg.headless && !s_cfg.vip_timing)
 		{
 			c.mov(args[0], 1);
 			c.call(imm_ptr(&::Sleep));
-			c.mov(state, imm_ptr(&g_state));
+			restore_state(c);
 		}
 
-		if (::has_movbe())
+		// End the time slice when the budget runs out
+		Label exhausted = c.newLabel();
+
+		if (s_cfg.vip_timing)
 		{
-			if (g_sleep_supported)
+			// The budget is in machine cycles, the instruction crossing zero completes and overruns it
+			c.inc(x86::qword_ptr(state, STATE_OFFS(inst_count)));
+
+			if (std::exchange(s_var_cost, false))
 			{
-				// Clear upper bits of the register in case changed by Sleep
-				c.movzx(args[1].r32(), args[1].r8());
+				c.add(x86::r15d, cycles);
+				c.sub(x86::dword_ptr(state, STATE_OFFS(inst_budget)), x86::r15d);
 			}
+			else
+			{
+				c.sub(x86::dword_ptr(state, STATE_OFFS(inst_budget)), cycles);
+			}
+		}
+		else
+		{
+			c.dec(x86::dword_ptr(state, STATE_OFFS(inst_budget)));
+		}
+
+		if (std::exchange(s_end_slice, false))
+		{
+			c.jmp(exhausted);
+		}
+		else
+		{
+			// Borrow or zero
+			s_cfg.vip_timing ? c.jbe(exhausted) : c.je(exhausted);
+		}
 
-			c.movbe(args[1].r16(), x86::word_ptr(state, pc, 0, STATE_OFFS(memBase)));
+		if (::get_cpu_features().movbe)
+		{
+			// Clear upper bits of the register (movbe only writes 16 bits)
+			c.movzx(args[1].r32(), args[1].r8());
+			c.movbe(args[1].r16(), x86::word_ptr(mem, pc));
 		}
 		else
 		{
-			c.movzx(args[1].r32(), x86::word_ptr(state, pc, 0, STATE_OFFS(memBase)));
+			c.movzx(args[1].r32(), x86::word_ptr(mem, pc));
 			c.xchg(x86::dl, x86::dh); // Byteswap
 		}
 
 		// Jumptable
-		c.jmp(x86::qword_ptr(state, args[1], ARR_SUBSCRIPT(ops)));
+		dispatch(c, args[1]);
+
+		c.bind(exhausted);
+		exit_with(c, exit_reason::none);
 
 		// Emit optional code
 		if (auto builder = std::move(from_end))
@@ -356,12 +621,157 @@ asm_insts::func_t build_instruction(const F& func, const bool jump)
 	});
 }
 
-void asm_insts::build_all(std::uintptr_t* table)
+// Returns the table of the config, compiles it if needed (the build mutex must be held)
+static const asm_insts::func_t* get_table(const asm_insts::config_t& cfg)
+{
+	const u32 key = u32{cfg.is_super} | (u32{cfg.headless} << 1) | (u32{cfg.vip_timing} << 2) | (cfg.quirks.bits() << 3);
+	auto& cached = s_tables[key];
+
+	if (!cached)
+	{
+		// 00FA switches to the table with the index increment, compile it first (compiling uses the statics)
+		const asm_insts::func_t* compat = nullptr;
+
+		if (cfg.is_super && !cfg.quirks.index_increment)
+		{
+			asm_insts::config_t compat_cfg = cfg;
+			compat_cfg.quirks.index_increment = true;
+			compat = get_table(compat_cfg);
+		}
+
+		// The lazy table follows the normal one
+		cached = std::make_unique<asm_insts::func_t[]>(2 * (UINT16_MAX + 1));
+		s_cfg = cfg;
+		s_table = cached.get();
+		s_compat_table = compat ? compat : cached.get();
+		asm_insts::build_table(cached.get());
+	}
+
+	return cached.get();
+}
+
+const std::uintptr_t* asm_insts::build_all(const config_t& cfg)
+{
+	std::lock_guard<std::mutex> lock(s_build_mutex);
+
+	const func_t* table = get_table(cfg);
+
+	// Build actual entry (shared by all configs)
+	if (!entry)
+	{
+		entry = build_entry();
+	}
+
+	return table;
+}
+
+// What an instruction does with VF (decides what happens to the pending VF of the last DRW)
+enum class vf_use
+{
+	none, // Keep it pending
+	overwrite, // Drop it (VF is written without being read)
+	resolve, // Compute it first (VF is read, or the framebuffer, the sprite or the mode may change)
+};
+
+static vf_use get_vf_use(u32 op)
+{
+	const bool x = getField<2>(static_cast<u16>(op)) == 0xf;
+	const bool y = getField<1>(static_cast<u16>(op)) == 0xf;
+
+	switch (op >> 12)
+	{
+	case 0x0: return op == 0x00EE ? vf_use::none : vf_use::resolve;
+	case 0x1:
+	case 0x2:
+	case 0xA: return vf_use::none;
+	case 0xB: return s_cfg.quirks.jump_vx && x ? vf_use::resolve : vf_use::none;
+	case 0x3:
+	case 0x4:
+	case 0x7: return x ? vf_use::resolve : vf_use::none;
+	case 0x5:
+	case 0x9: return x || y ? vf_use::resolve : vf_use::none;
+	case 0x6:
+	case 0xC: return x ? vf_use::overwrite : vf_use::none;
+	case 0x8:
+	{
+		if (y || (x && (op & 0xf) != 0))
+		{
+			return vf_use::resolve;
+		}
+
+		switch (op & 0xf)
+		{
+		case 0x0: return x ? vf_use::overwrite : vf_use::none;
+		case 0x1:
+		case 0x2:
+		case 0x3: return s_cfg.quirks.vf_reset ? vf_use::overwrite : vf_use::none;
+		case 0x4:
+		case 0x5:
+		case 0x6:
+		case 0x7:
+		case 0xE: return vf_use::overwrite;
+		default: return vf_use::resolve;
+		}
+	}
+	case 0xD: return x || y ? vf_use::resolve : vf_use::overwrite;
+	case 0xE: return !x && ((op & 0xff) == 0x9E || (op & 0xff) == 0xA1) ? vf_use::none : vf_use::resolve;
+	case 0xF:
+	{
+		switch (op & 0xff)
+		{
+		case 0x07:
+		case 0x65:
+		case 0x85: return x ? vf_use::overwrite : vf_use::none;
+		case 0x15:
+		case 0x18:
+		case 0x1E:
+		case 0x29:
+		case 0x75: return x ? vf_use::resolve : vf_use::none;
+		default: return vf_use::resolve; // FX0A waits or leaves, FX33 and FX55 write memory
+		}
+	}
+	}
+
+	return vf_use::resolve;
+}
+
+// Compute VF of the last DRW, then run the instruction from the normal table
+static asm_insts::func_t build_resolve(const asm_insts::func_t* table)
+{
+	return build_function_asm<asm_insts::func_t>([&](X86Assembler& c)
+	{
+		c.mov(x86::qword_ptr(x86::rsp, SCRATCH_SLOT), opcode);
+		c.call(imm_ptr(&resolve_draw));
+		restore_state(c);
+		c.mov(opcode, x86::qword_ptr(x86::rsp, SCRATCH_SLOT));
+		c.mov(retn, imm_ptr(table));
+		c.jmp(x86::qword_ptr(retn, opcode, GET_SHIFT(asm_insts::func_t)));
+	});
+}
+
+void asm_insts::build_table(std::uintptr_t* table)
 {
+	// DRW leaves VF pending and continues in the lazy table, where instructions needing VF compute it first
+	// Instructions of the lazy table continue in it until VF is resolved or overwritten
+	const auto lazy = table + UINT16_MAX + 1;
+	const func_t resolve = build_resolve(table);
+
 	for (const auto& entry : all_ops)
 	{
-		// Compile the instruction using the builder
-		const std::remove_pointer_t<decltype(table)> func_ptr = build_instruction(entry.builder, entry.is_jump);
+		const bool is_draw = entry.builder == &asm_insts::DRW || entry.builder == &asm_insts::XDRW;
+		const bool is_compat = entry.builder == &asm_insts::Compat;
+
+		// Compile the instruction using the builder (for each table)
+		s_table = is_draw ? lazy : is_compat ? s_compat_table : table;
+		s_lazy = is_draw;
+		const std::remove_pointer_t<decltype(table)> func_ptr = build_instruction(entry.builder, entry.is_jump, entry.cycles);
+
+		s_table = lazy;
+		s_lazy = true;
+		const std::remove_pointer_t<decltype(table)> lazy_ptr = is_draw ? func_ptr : build_instruction(entry.builder, entry.is_jump, entry.cycles);
+
+		s_table = table;
+		s_lazy = false;
 
 		// Get instruction pattern mask and pattern opcode 
 		const u32 imask = entry.mask;
@@ -403,12 +813,17 @@ void asm_insts::build_all(std::uintptr_t* table)
 			}
 
 			table[op] = func_ptr;
+
+			switch (get_vf_use(op))
+			{
+			case vf_use::none: lazy[op] = lazy_ptr; break;
+			case vf_use::overwrite: lazy[op] = func_ptr; break;
+			case vf_use::resolve: lazy[op] = resolve; break;
+			}
+
 			op += m0(0x1);
 		}
 	}
-
-	// Build actual entry
-	entry = build_entry();
 }
 
 decltype(asm_insts::entry) asm_insts::build_entry()
@@ -416,7 +831,6 @@ decltype(asm_insts::entry) asm_insts::build_entry()
 	return build_function_asm<decltype(asm_insts::entry)>([](X86Assembler& c)
 	{
 		Label is_exit = c.newLabel();
-		c.mov(args[0], imm_ptr(&g_state));
 		c.cmp(x86::byte_ptr(args[0], STATE_OFFS(emu_started)), (u8)true);
 		c.je(is_exit);
 
@@ -430,14 +844,17 @@ decltype(asm_insts::entry) asm_insts::build_entry()
 		c.push(x86::rdi);
 		c.push(x86::rbx);
 		c.sub(x86::rsp, STACK_RESERVE); // Allocate min stack frame
-		c.mov(state, imm_ptr(&g_state));
+		c.mov(x86::qword_ptr(x86::rsp, STATE_SLOT), state); // The state is passed as the first argument
 		c.mov(pc.r32(), x86::dword_ptr(state, STATE_OFFS(pc))); // Load pc
-		c.movzx(args[1].r32(), x86::word_ptr(state, pc, 0, STATE_OFFS(memBase)));
+		c.mov(mem, x86::qword_ptr(state, STATE_OFFS(memBase))); // Load memory base
+		c.movzx(args[1].r32(), x86::word_ptr(mem, pc));
 		c.xchg(x86::dl, x86::dh); // Byteswap
-		c.jmp(x86::qword_ptr(state, args[1], ARR_SUBSCRIPT(ops)));
+		c.mov(retn, x86::qword_ptr(state, STATE_OFFS(ops)));
+		c.jmp(x86::qword_ptr(retn, args[1], GET_SHIFT(asm_insts::func_t)));
 
 		c.bind(is_exit);
 		c.mov(x86::dword_ptr(state, STATE_OFFS(pc)), pc.r32());
+		c.mov(x86::byte_ptr(state, STATE_OFFS(emu_started)), (u8)false);
 		c.add(x86::rsp, STACK_RESERVE);
 		c.pop(x86::rbx);
 		c.pop(x86::rdi);
@@ -453,88 +870,30 @@ decltype(asm_insts::entry) asm_insts::build_entry()
 
 void asm_insts::CLS(X86Assembler& c)
 {
-	Label extended_mode = c.newLabel();
-	Label end = c.newLabel();
+	// Lines tagged with an older epoch read as zero, DRW zeroes them when it touches them
+	Label present = c.newLabel();
+	c.inc(x86::byte_ptr(state, STATE_OFFS(gfx_epoch)));
+	c.jne(present);
 
-	if (::has_avx())
-	{
-		// Try to use AVX if possible
-		c.vxorps(x86::ymm0, x86::ymm0, x86::ymm0);
-		c.vmovaps(x86::ymm1, x86::ymm0);
-	}
-	else
-	{
-		c.xorps(x86::xmm0, x86::xmm0);
-		c.movaps(x86::xmm1, x86::xmm0);
-	}
+	// The epoch wrapped around: clear the framebuffer and the tags for real (once every 256 CLS)
+	const u32 vsize = vector_size();
+	vector_zero(c, 0);
 
-	c.lea(x86::r9, lea_ptr(state, STATE_OFFS(gfxMemory)));
-
-	if (g_state.is_super)
+	for (u32 offs = 0; offs < sizeof(emu_state::row_epoch); offs += vsize)
 	{
-		c.cmp(x86::byte_ptr(state, STATE_OFFS(extended)), 0);
-		c.jne(extended_mode);
+		vector_store(c, x86::ptr(state, STATE_OFFS(row_epoch) + offs), 0);
 	}
 
-	// Simply generate the two modes handlers at once
-	for (size_t extended = 0, y_size = emu_state::y_size;; extended = 1, y_size *= 2)
+	for (u32 offs = 0; offs < sizeof(emu_state::gfxMemory); offs += vsize)
 	{
-		Label loop_ = c.newLabel();
-
-		c.mov(x86::ecx, (emu_state::y_stride * y_size) / 256);
-		c.bind(loop_);
-
-		// Use out-of-order execution by using more than one register
-		for (u32 i = 0; i < u32(!extended ? 4 : 2); i++)
-		{
-			if (::has_avx())
-			{
-				c.vmovaps(x86::yword_ptr(x86::r9, i * emu_state::y_stride + 0), x86::ymm0);
-				c.vmovaps(x86::yword_ptr(x86::r9, i * emu_state::y_stride + 32), x86::ymm1);
-
-				if (extended)
-				{
-					c.vmovaps(x86::yword_ptr(x86::r9, i * emu_state::y_stride + 64), x86::ymm0);
-					c.vmovaps(x86::yword_ptr(x86::r9, i * emu_state::y_stride + 96), x86::ymm1);
-				}
-			}
-			else
-			{
-				c.movaps(x86::oword_ptr(x86::r9, i * emu_state::y_stride + 0), x86::xmm0);
-				c.movaps(x86::oword_ptr(x86::r9, i * emu_state::y_stride + 16), x86::xmm1);
-				c.movaps(x86::oword_ptr(x86::r9, i * emu_state::y_stride + 32), x86::xmm0);
-				c.movaps(x86::oword_ptr(x86::r9, i * emu_state::y_stride + 48), x86::xmm1);
-
-				if (extended)
-				{
-					c.movaps(x86::oword_ptr(x86::r9, i * emu_state::y_stride + 64), x86::xmm0);
-					c.movaps(x86::oword_ptr(x86::r9, i * emu_state::y_stride + 80), x86::xmm1);
-					c.movaps(x86::oword_ptr(x86::r9, i * emu_state::y_stride + 96), x86::xmm0);
-					c.movaps(x86::oword_ptr(x86::r9, i * emu_state::y_stride + 112), x86::xmm1);
-				}
-			}
-		}
-
-		c.add(x86::r9, 256); // Fill 256 bytes each loop
-		try_loop(c, loop_);
-
-		c.mov(args[0], bitcast<u64>(&g_state) + zext<u64>(STATE_OFFS(gfxMemory))); // Set gfxMemory* as argument
-		c.call(imm_ptr(std::addressof(extended ? ::KickSChip8Framebuffer : ::KickChip8Framebuffer)));
-
-		if (extended != 0 || !g_state.is_super)
-		{
-			// Don't generate extended mode handler for non-super
-			break;
-		}
-
-		// Bind extended mode label at the middle, skip if non-extended
-		c.jmp(end);
-		c.align(kAlignData, 16);
-		c.bind(extended_mode);
+		vector_store(c, x86::ptr(state, STATE_OFFS(gfxMemory) + offs), 0);
 	}
 
-	c.bind(end);
-	c.mov(state, imm_ptr(&g_state));
+	leave_avx(c);
+
+	c.bind(present);
+	c.call(imm_ptr(&present_frame)); // state* is already the argument
+	restore_state(c);
 }
 
 void asm_insts::RET(X86Assembler& c)
@@ -545,11 +904,7 @@ void asm_insts::RET(X86Assembler& c)
 	// Check stack underflow
 	Label ok = c.newLabel();
 	c.jns(ok);
-	c.mov(x86::r8, imm_ptr("RET stack underflow"));
-	c.mov(x86::qword_ptr(state, STATE_OFFS(last_error)), x86::r8);
-	c.mov(x86::r8, imm_ptr(&asm_insts::entry));
-	c.mov(x86::r8, x86::qword_ptr(x86::r8));
-	c.jmp(x86::r8);;
+	exit_with(c, exit_reason::stack_underflow, "RET stack underflow");
 	c.bind(ok);
 
 	c.mov(x86::dword_ptr(state, STATE_OFFS(sp)), x86::r8d);
@@ -558,51 +913,51 @@ void asm_insts::RET(X86Assembler& c)
 
 void asm_insts::Compat(X86Assembler& c)
 {
-	if (!g_state.is_super)
+	if (!s_cfg.is_super)
 	{
-		c.jmp(x86::qword_ptr(state, STATE_OFFS(ops) + s_ops::UNK * GET_SIZE_MEM(ops)));
+		jump_to(c, s_ops::UNK);
 	}
 
 	c.mov(x86::byte_ptr(state, STATE_OFFS(compatibilty)), 0u - 1u);
+
+	// Continue with the index increment on (this handler dispatches through that table too)
+	c.mov(retn, imm_ptr(s_compat_table));
+	c.mov(x86::qword_ptr(state, STATE_OFFS(ops)), retn);
 }
 
 // Builder for SCR and SCL
 template<bool is_SCR>
 static void form_SCRL(X86Assembler& c)
 {
-	if (!g_state.is_super)
+	if (!s_cfg.is_super)
 	{
-		c.jmp(x86::qword_ptr(state, STATE_OFFS(ops) + s_ops::UNK * GET_SIZE_MEM(ops)));
+		jump_to(c, s_ops::UNK);
 	}
 
 	Label extended_mode = c.newLabel();
 	Label end = c.newLabel();
+	const u32 vsize = vector_size();
 
-	const X86Gp& source = is_SCR ? x86::rsi : x86::rdi;
-	const X86Gp& dest = is_SCR ? x86::rdi : x86::rsi;
-	c.lea(source, lea_ptr(state, STATE_OFFS(gfxMemory)));
-	c.lea(dest, lea_ptr(state, STATE_OFFS(gfxMemory) + sizeof(u32))); // Offset 4 pixels destintion
+	// All lines are shifted regardless of the row base and their epoch (cleared lines read as zero anyway)
 	c.cmp(x86::byte_ptr(state, STATE_OFFS(extended)), (u8)true);
 	c.je(extended_mode);
 
 	// Simply generate the two modes handlers at once
-	for (size_t extended = 0, y_size = emu_state::y_size, x_size = emu_state::x_size;; extended = 1, y_size *= 2, x_size *= 2)
+	for (u32 extended = 0;; extended = 1)
 	{
 		Label loop_ = c.newLabel();
 
-		c.mov(x86::r8d, y_size);
+		c.lea(x86::r9, lea_ptr(state, STATE_OFFS(gfxMemory)));
+		c.mov(x86::r8d, sizeof(emu_state::gfxMemory) / vsize);
 		c.bind(loop_);
-		c.mov(x86::ecx, zext<u32>((x_size - 4) / sizeof(u32))); // move bytes in dwords
-		c.rep().movsd();
-		c.mov(x86::dword_ptr(dest, is_SCR ? 0 - zext<s32>(y_size) : s32(-4)), 0); // Place zeroes on the edge of the screen
-		c.add(source, emu_state::y_stride - (x_size - 4));
-		c.add(dest, emu_state::y_stride - (x_size - 4));
+
+		// The second word of a line is unused (zero) in non-extended mode, it must stay that way
+		vector_shift_lines(c, is_SCR, extended != 0);
+
+		c.add(x86::r9, vsize);
 		c.dec(x86::r8d);
 		c.jne(loop_);
 
-		c.mov(args[0], bitcast<u64>(&g_state) + zext<u64>(STATE_OFFS(gfxMemory))); // Set gfxMemory* as argument
-		c.call(imm_ptr(std::addressof(extended ? ::KickSChip8Framebuffer : ::KickChip8Framebuffer)));
-
 		if (extended != 0)
 		{
 			break;
@@ -615,7 +970,9 @@ static void form_SCRL(X86Assembler& c)
 	}
 
 	c.bind(end);
-	c.mov(state, imm_ptr(&g_state));
+	leave_avx(c);
+	c.call(imm_ptr(&present_frame)); // state* is already the argument
+	restore_state(c);
 }
 
 void asm_insts::SCR(X86Assembler& c)
@@ -627,35 +984,78 @@ void asm_insts::SCL(X86Assembler& c)
 	form_SCRL<false>(c);
 }
 
+void asm_insts::SCD(X86Assembler& c)
+{
+	if (!s_cfg.is_super)
+	{
+		jump_to(c, s_ops::UNK);
+	}
+
+	Label loop_ = c.newLabel();
+	Label end = c.newLabel();
+
+	// Rotate the lines instead of moving them: the row base moves up by N lines
+	getField<0>(c, x86::r8);
+	c.je(end); // Flags set at getField
+	c.sub(x86::byte_ptr(state, STATE_OFFS(row_base)), x86::r8b);
+
+	// Clear the N lines entering at the top (the ones scrolled out at the bottom)
+	c.movzx(x86::r9d, x86::byte_ptr(state, STATE_OFFS(row_base)));
+	c.movzx(x86::r10d, x86::byte_ptr(state, STATE_OFFS(gfx_epoch)));
+	c.xor_(x86::eax, x86::eax);
+	c.bind(loop_);
+	c.mov(x86::r11d, x86::r9d);
+	c.and_(x86::r11d, emu_state::y_size_ex - 1);
+	c.mov(x86::byte_ptr(state, x86::r11, 0, STATE_OFFS(row_epoch)), x86::r10b);
+	c.shl(x86::r11d, 4);
+	c.mov(x86::qword_ptr(state, x86::r11, 0, STATE_OFFS(gfxMemory)), x86::rax);
+	c.mov(x86::qword_ptr(state, x86::r11, 0, STATE_OFFS(gfxMemory) + 8), x86::rax);
+	c.inc(x86::r9d);
+	c.dec(x86::r8d);
+	c.jne(loop_);
+
+	c.bind(end);
+	c.call(imm_ptr(&present_frame)); // state* is already the argument
+	restore_state(c);
+}
+
 void asm_insts::RESL(X86Assembler& c)
 {
-	if (!g_state.is_super)
+	if (!s_cfg.is_super)
 	{
-		c.jmp(x86::qword_ptr(state, STATE_OFFS(ops) + s_ops::UNK * GET_SIZE_MEM(ops)));
+		jump_to(c, s_ops::UNK);
 	}
 
 	c.mov(x86::byte_ptr(state, STATE_OFFS(extended)), u8{false});
 
 	// TODO: is the screen cleared even when resolution didnt change?
-	c.jmp(x86::qword_ptr(state, STATE_OFFS(ops) + s_ops::CLS * GET_SIZE_MEM(ops)));
+	jump_to(c, s_ops::CLS);
 }
 
 void asm_insts::RESH(X86Assembler& c)
 {
-	if (!g_state.is_super)
+	if (!s_cfg.is_super)
 	{
-		c.jmp(x86::qword_ptr(state, STATE_OFFS(ops) + s_ops::UNK * GET_SIZE_MEM(ops)));
+		jump_to(c, s_ops::UNK);
 	}
 
 	c.mov(x86::byte_ptr(state, STATE_OFFS(extended)), u8{true});
 
 	// TODO: is the screen cleared even when resolution didnt change?
-	c.jmp(x86::qword_ptr(state, STATE_OFFS(ops) + s_ops::CLS * GET_SIZE_MEM(ops)));
+	jump_to(c, s_ops::CLS);
 }
 
 void asm_insts::JP(X86Assembler& c)
 {
 	c.and_(opcode.r32(), 0xFFF); // Extract addr
+
+	// Jump to itself: nothing can change anymore, leave
+	Label ok = c.newLabel();
+	c.cmp(opcode.r32(), pc.r32());
+	c.jne(ok);
+	exit_with(c, exit_reason::halted);
+	c.bind(ok);
+
 	c.mov(pc.r32(), opcode.r32());
 }
 
@@ -668,11 +1068,7 @@ void asm_insts::CALL(X86Assembler& c)
 	Label ok = c.newLabel();
 	c.cmp(x86::r8d, zext<u32>(std::size(g_state.stack)) - 1);
 	c.jne(ok);
-	c.mov(x86::r8, imm_ptr("CALL stack overflow"));
-	c.mov(x86::qword_ptr(state, STATE_OFFS(last_error)), x86::r8);
-	c.mov(x86::r8, imm_ptr(&asm_insts::entry));
-	c.mov(x86::r8, x86::qword_ptr(x86::r8));
-	c.jmp(x86::r8);
+	exit_with(c, exit_reason::stack_overflow, "CALL stack overflow");
 	c.bind(ok);
 
 	c.add(pc.r32(), 2);
@@ -736,6 +1132,11 @@ void asm_insts::OR(X86Assembler& c)
 	getX(c, opcode);
 	c.mov(x86::r8b, x86::byte_ptr(state, x86::r8, 0, STATE_OFFS(gpr)));
 	c.or_(x86::byte_ptr(state, x86::rdx, 0, STATE_OFFS(gpr)), x86::r8b);
+
+	if (s_cfg.quirks.vf_reset)
+	{
+		c.mov(refVF(), u8{0});
+	}
 }
 
 void asm_insts::AND(X86Assembler& c)
@@ -744,6 +1145,11 @@ void asm_insts::AND(X86Assembler& c)
 	getX(c, opcode);
 	c.mov(x86::r8b, x86::byte_ptr(state, x86::r8, 0, STATE_OFFS(gpr)));
 	c.and_(x86::byte_ptr(state, x86::rdx, 0, STATE_OFFS(gpr)), x86::r8b);
+
+	if (s_cfg.quirks.vf_reset)
+	{
+		c.mov(refVF(), u8{0});
+	}
 }
 
 void asm_insts::XOR(X86Assembler& c)
@@ -752,6 +1158,11 @@ void asm_insts::XOR(X86Assembler& c)
 	getX(c, opcode);
 	c.mov(x86::r8b, x86::byte_ptr(state, x86::r8, 0, STATE_OFFS(gpr)));
 	c.xor_(x86::byte_ptr(state, x86::rdx, 0, STATE_OFFS(gpr)), x86::r8b);
+
+	if (s_cfg.quirks.vf_reset)
+	{
+		c.mov(refVF(), u8{0});
+	}
 }
 
 void asm_insts::ADD(X86Assembler& c)
@@ -777,13 +1188,33 @@ void asm_insts::SUB(X86Assembler& c)
 	c.mov(x86::byte_ptr(state, x86::rdx, 0, STATE_OFFS(gpr)), x86::r9b);
 }
 
-void asm_insts::SHR(X86Assembler& c)
+// Builder for SHR and SHL
+template<bool is_SHR>
+static void form_shift(X86Assembler& c)
 {
+	if (s_cfg.quirks.shift_vy)
+	{
+		// VX = VY shifted
+		getY(c, x86::r8);
+		c.mov(x86::r8b, x86::byte_ptr(state, x86::r8, 0, STATE_OFFS(gpr)));
+		is_SHR ? c.shr(x86::r8b, 1) : c.shl(x86::r8b, 1);
+		c.setc(x86::r9b);
+		getX(c, opcode);
+		c.mov(x86::byte_ptr(state, x86::rdx, 0, STATE_OFFS(gpr)), x86::r8b);
+		c.mov(refVF(), x86::r9b);
+		return;
+	}
+
 	getX(c, opcode);
-	c.shr(x86::byte_ptr(state, x86::rdx, 0, STATE_OFFS(gpr)), 1);
+	is_SHR ? c.shr(x86::byte_ptr(state, x86::rdx, 0, STATE_OFFS(gpr)), 1) : c.shl(x86::byte_ptr(state, x86::rdx, 0, STATE_OFFS(gpr)), 1);
 	c.setc(refVF());
 }
 
+void asm_insts::SHR(X86Assembler& c)
+{
+	form_shift<true>(c);
+}
+
 void asm_insts::RSB(X86Assembler& c)
 {
 	getY(c, x86::r8);
@@ -797,9 +1228,7 @@ void asm_insts::RSB(X86Assembler& c)
 
 void asm_insts::SHL(X86Assembler& c)
 {
-	getX(c, opcode);
-	c.shl(x86::byte_ptr(state, x86::rdx, 0, STATE_OFFS(gpr)), 1);
-	c.setc(refVF());
+	form_shift<false>(c);
 }
 
 void asm_insts::SNE(X86Assembler& c)
@@ -820,17 +1249,38 @@ void asm_insts::SetIndex(X86Assembler& c)
 
 void asm_insts::JPr(X86Assembler& c)
 {
+	if (s_cfg.quirks.jump_vx)
+	{
+		// BXNN: the register is the top digit of the address
+		getX(c, x86::r8);
+		c.movzx(x86::r8d, x86::byte_ptr(state, x86::r8, 0, STATE_OFFS(gpr)));
+	}
+	else
+	{
+		c.movzx(x86::r8d, x86::byte_ptr(state, STATE_OFFS(gpr) + 0));
+	}
+
 	c.and_(opcode.r32(), 0xFFF);
-	c.movzx(x86::r8d, x86::byte_ptr(state, STATE_OFFS(gpr) + 0));
 	c.lea(pc.r32(), lea_ptr(opcode, x86::r8d));
 }
 
 void asm_insts::RND(X86Assembler& c)
 {
 	c.mov(x86::r8d, opcode.r32()); // Save rdx
-	c.rdtsc();
-	c.shr(x86::eax, 8);
-	c.and_(x86::al, x86::r8b); // Mask timestamp
+
+	// xorshift32 step (see emu_state::next_random)
+	c.mov(x86::eax, x86::dword_ptr(state, STATE_OFFS(rng_state)));
+	c.mov(x86::r9d, x86::eax);
+	c.shl(x86::r9d, 13);
+	c.xor_(x86::eax, x86::r9d);
+	c.mov(x86::r9d, x86::eax);
+	c.shr(x86::r9d, 17);
+	c.xor_(x86::eax, x86::r9d);
+	c.mov(x86::r9d, x86::eax);
+	c.shl(x86::r9d, 5);
+	c.xor_(x86::eax, x86::r9d);
+	c.mov(x86::dword_ptr(state, STATE_OFFS(rng_state)), x86::eax);
+	c.and_(x86::al, x86::r8b); // Mask random value
 	getX(c, x86::r8, x86::r8);
 	c.mov(x86::byte_ptr(state, x86::r8, 0, STATE_OFFS(gpr)), x86::al);
 }
@@ -838,200 +1288,207 @@ void asm_insts::RND(X86Assembler& c)
 template<bool is_XDRW>
 static void form_DRW(X86Assembler& c)
 {
-	Label main_loop = c.newLabel();
-	Label skip_size0 = c.newLabel();
-	Label table_lookup = c.newLabel();
-	Label needs_wrapping = c.newLabel();
+	Label row_loop = c.newLabel();
+	Label current = c.newLabel();
+	Label next_row = c.newLabel();
+	Label done = c.newLabel();
+
+	const bool is_super = s_cfg.is_super;
+	const bool wrapping = s_cfg.quirks.draw_wrap;
 
-	// Ram pointer
+	// Record the draw, VF is computed from it when needed (see build_table)
 	c.mov(x86::r8d, x86::dword_ptr(state, STATE_OFFS(index)));
-	c.lea(x86::r8, lea_ptr(state, x86::r8, 0, STATE_OFFS(memBase)));
+	c.mov(x86::dword_ptr(state, STATE_OFFS(draw_addr)), x86::r8d);
+	c.mov(x86::byte_ptr(state, STATE_OFFS(draw_wide)), u8{is_XDRW});
 
-	const bool is_super = g_state.is_super;
-	if (is_super)
+	// Sprite pointer
+	c.add(x86::r8, mem);
+
+	// Get lines amount (kept on the stack, registers are short)
+	if (!is_XDRW)
 	{
-		// Load is_extended value
-		c.movzx(x86::ebx, x86::byte_ptr(state, STATE_OFFS(extended)));
-		c.mov(x86::r11d, x86::ebx);
-		c.shl(x86::r11b, clog2<0x3f>()); // Shift it to the bit exactly after the end of 0x1f
-		c.or_(x86::r11b, 0x3f); // Now we OR it (to get 0x7f on extended mode)
+		getField<0>(c, x86::rbx);
+		c.mov(x86::byte_ptr(state, STATE_OFFS(draw_rows)), x86::bl);
+		c.je(done); // Flags set at getField
+		c.mov(x86::dword_ptr(x86::rsp, SCRATCH_SLOT), x86::ebx);
+	}
+	else
+	{
+		c.mov(x86::byte_ptr(state, STATE_OFFS(draw_rows)), u8{16});
+		c.mov(x86::dword_ptr(x86::rsp, SCRATCH_SLOT), 16);
 	}
 
 	getX(c, x86::r10);
-	c.mov(x86::r10b, x86::byte_ptr(state, x86::r10, 0, STATE_OFFS(gpr)));
+	c.movzx(x86::r10d, x86::byte_ptr(state, x86::r10, 0, STATE_OFFS(gpr)));
+	getY(c, x86::r12);
+	c.movzx(x86::r12d, x86::byte_ptr(state, x86::r12, 0, STATE_OFFS(gpr)));
 
-	// Apply x mask
-	if (is_super) 
+	if (is_super)
 	{
-		c.and_(x86::r10d, x86::r11d);
-		c.shr(x86::r11d, 1); // In all modes x lines is twice as much as y lines
+		// Apply x and y masks of the current mode (0x3f/0x1f or 0x7f/0x3f)
+		c.movzx(x86::r11d, x86::byte_ptr(state, STATE_OFFS(extended)));
+		c.mov(x86::eax, x86::r11d);
+		c.shl(x86::eax, 6);
+		c.or_(x86::eax, 0x3f);
+		c.and_(x86::r10d, x86::eax);
+		c.shr(x86::eax, 1);
+		c.and_(x86::r12d, x86::eax);
+
+		// Screen height
+		c.lea(x86::edi, x86::ptr(x86::rax, 1));
 	}
 	else
 	{
-		c.and_(x86::r10b, 0x3f);
+		c.and_(x86::r10d, 0x3f);
+		c.and_(x86::r12d, 0x1f);
 	}
 
-	getY(c, x86::r9);
-	c.mov(x86::r9b, x86::byte_ptr(state, x86::r9, 0, STATE_OFFS(gpr)));
+	c.mov(x86::byte_ptr(state, STATE_OFFS(draw_x)), x86::r10b);
+	c.mov(x86::byte_ptr(state, STATE_OFFS(draw_y)), x86::r12b);
 
-	if (is_super) // Apply y mask
-		c.and_(x86::r9d, x86::r11d);
-	else
-		c.and_(x86::r9d, 0x1f);
+	// Offset of the word the sprite starts in
+	c.mov(x86::esi, x86::r10d);
+	c.shr(x86::esi, 6);
+	c.shl(x86::esi, 3);
 
-	// Constant value unchanged with modes
-	c.shl(x86::r9d, flog2<emu_state::y_stride>());
-
-	// Vram offset
-	c.add(x86::r9d, x86::r10d);
-
-	// VF setup
-	c.xor_(x86::r11d, x86::r11d);
-	c.mov(x86::r14d, 1);
-
-	// Get lines amount
-	if (!is_XDRW)
+	if (is_super)
 	{
-		getField<0>(c, opcode);
-		c.je(skip_size0); // Flags set at getField
+		// Offset of the word receiving the bits shifted out: the next one, or the first one past the right edge
+		c.mov(x86::r9d, x86::esi);
+		c.shr(x86::r9d, 3);
+		c.inc(x86::r9d);
+		c.and_(x86::r9d, x86::r11d);
+		c.shl(x86::r9d, 3);
+
+		if (!wrapping)
+		{
+			// Mask of the shifted out bits (only the first word of an extended line has a next one)
+			c.mov(x86::r14d, x86::esi);
+			c.shr(x86::r14d, 3);
+			c.xor_(x86::r14d, 1);
+			c.and_(x86::r14d, x86::r11d);
+			c.neg(x86::r14);
+		}
 	}
 	else
 	{
-		c.mov(opcode.r32(), 16);
-	}
+		c.xor_(x86::r9d, x86::r9d);
 
-	c.mov(x86::r12d, opcode.r32());
-	c.shl(x86::r12d, flog2<emu_state::y_stride>());
-	c.lea(x86::r12, lea_ptr(x86::r9, x86::r12, 0, !is_XDRW ? 7 : 15));
+		if (!wrapping)
+		{
+			c.xor_(x86::r14d, x86::r14d);
+		}
+	}
 
-	if (is_super)
+	// State in rbx, shift amount within the word in cl, current epoch in ch (state is restored from the stack after)
+	c.mov(x86::rbx, state);
+	c.movzx(x86::ecx, x86::byte_ptr(state, STATE_OFFS(gfx_epoch)));
+	c.shl(x86::ecx, 8);
+	c.and_(x86::r10d, 63);
+	c.or_(x86::ecx, x86::r10d);
+
+	c.align(kAlignCode, 16);
+	c.bind(row_loop);
+
+	// Line pointer (visible line in r12 rotated by the row base)
+	c.movzx(x86::eax, x86::byte_ptr(x86::rbx, STATE_OFFS(row_base)));
+	c.add(x86::eax, x86::r12d);
+	c.and_(x86::eax, emu_state::y_size_ex - 1);
+	c.mov(x86::r10d, x86::eax);
+	c.shl(x86::r10d, 4);
+	c.lea(x86::r10, lea_ptr(x86::rbx, x86::r10, 0, STATE_OFFS(gfxMemory)));
+
+	// Zero the line if it was cleared since last drawn
+	c.cmp(x86::byte_ptr(x86::rbx, x86::rax, 0, STATE_OFFS(row_epoch)), x86::ch);
+	c.je(current);
+	c.mov(x86::byte_ptr(x86::rbx, x86::rax, 0, STATE_OFFS(row_epoch)), x86::ch);
+	c.xor_(x86::eax, x86::eax);
+	c.mov(x86::qword_ptr(x86::r10), x86::rax);
+	c.mov(x86::qword_ptr(x86::r10, 8), x86::rax);
+	c.bind(current);
+
+	// Load the sprite line into the top bits (leftmost pixel is the MSB)
+	if (is_XDRW)
 	{
-		c.mov(x86::r15d, x86::ebx);
-		c.neg(x86::r15d); // = extended ? 0xFFFFFFFF : 0
-		c.and_(x86::r15d, ~emu_state::xy_mask & emu_state::xy_mask_ex); // Get different bits in mask between modes and mask them
-		c.or_(x86::r15d, emu_state::xy_mask); // Get the actual mask
-		c.not_(x86::r15d);
-		c.test(x86::r12d, x86::r15d);
+		c.movzx(x86::eax, x86::word_ptr(x86::r8));
+		c.rol(x86::ax, 8);
+		c.shl(x86::rax, 48);
+		c.add(x86::r8, 2);
 	}
 	else
 	{
-		c.test(x86::r12d, ~emu_state::xy_mask);
+		c.movzx(x86::eax, x86::byte_ptr(x86::r8));
+		c.shl(x86::rax, 56);
+		c.inc(x86::r8);
 	}
 
-	c.jne(needs_wrapping);
+	// Split into the bits of the word and the bits shifted out of it
+	c.xor_(x86::edx, x86::edx);
+	c.shrd(x86::rdx, x86::rax, x86::cl);
+	c.shr(x86::rax, x86::cl);
 
-	// Get max ram address
-	c.lea(x86::rdx, lea_ptr(x86::r8, x86::rdx, is_XDRW ? 1 : 0));
-	c.bind(main_loop);
-
-	// XDRW consumes 2 bytes at a time
-	for (u32 i = 0; i < (is_XDRW ? 2 : 1); i++)
+	if (!wrapping)
 	{
-		// Load pixel value and decode it
-		c.movzx(x86::r10d, x86::byte_ptr(x86::r8, i));
-		c.mov(x86::r10, x86::qword_ptr(state, x86::r10, ARR_SUBSCRIPT(DRWtable)));
-
-		// Load previous qword pixels state and test VF
-		c.mov(x86::r12, x86::qword_ptr(state, x86::r9, 0, STATE_OFFS(gfxMemory) + i * sizeof(u64)));
-		c.test(x86::r10, x86::r12);
-		c.cmovne(x86::r11d, x86::r14d);
-		c.xor_(x86::r10, x86::r12);
-		c.mov(x86::qword_ptr(state, x86::r9, 0, STATE_OFFS(gfxMemory) + i * sizeof(u64)), x86::r10);
+		c.and_(x86::rdx, x86::r14);
 	}
 
-	!is_XDRW ? c.inc(x86::r8) : c.lea(x86::r8, lea_ptr(x86::r8, 2));
-
-	c.add(x86::r9, emu_state::y_stride);
-	c.cmp(x86::r8, x86::rdx);
-	c.jne(main_loop);
+	// XOR (collision is found later from the result, see emu_state::draw_result)
+	c.xor_(x86::qword_ptr(x86::r10, x86::rsi), x86::rax);
+	c.xor_(x86::qword_ptr(x86::r10, x86::r9), x86::rdx);
 
-	c.bind(skip_size0);
-	c.mov(refVF(), x86::r11b);
-	c.lea(args[0], lea_ptr(state, STATE_OFFS(gfxMemory)));
+	// Bottom edge
+	c.inc(x86::r12d);
+	is_super ? c.cmp(x86::r12d, x86::edi) : c.cmp(x86::r12d, emu_state::y_size);
+	c.jb(next_row);
 
-	if (is_super)
+	if (wrapping)
 	{
-		c.mov(opcode, imm_ptr(&::KickChip8Framebuffer));
-		c.test(x86::bl, 0x1);
-		c.mov(x86::rbx, imm_ptr(&::KickSChip8Framebuffer));
-		c.cmovne(opcode, x86::rbx);
-		c.call(opcode);
+		// Continue from the top line
+		c.xor_(x86::r12d, x86::r12d);
 	}
 	else
 	{
-		c.call(imm_ptr(&::KickChip8Framebuffer));
+		// Clip at the bottom edge
+		c.jmp(done);
 	}
 
-	c.mov(state, imm_ptr(&g_state));
+	c.bind(next_row);
+	c.dec(x86::dword_ptr(x86::rsp, SCRATCH_SLOT));
+	c.jne(row_loop);
 
-	// Specilization for wrapping (slow but accurate)
-	from_end = [=](X86Assembler& c)
-	{
-		Label wrap_loop = c.newLabel();
-		Label wrap_skip = c.newLabel();
-		c.align(kAlignCode, 16);
-		c.bind(needs_wrapping);
+	c.bind(done);
+	restore_state(c);
+	c.call(imm_ptr(&present_draw)); // state* is already the argument
+	restore_state(c);
 
-		// Get max ram address
-		c.lea(x86::rdx, lea_ptr(x86::r8, x86::rdx));
-		c.bind(wrap_loop);
+	if (s_cfg.vip_timing)
+	{
+		// Variable part of the cost: rows, shifted bit by bit when not byte aligned
+		const u32 row_cycles = is_XDRW ? 2 * VIP_ROW_CYCLES : VIP_ROW_CYCLES;
+		const u32 shift_cycles = is_XDRW ? 2 * VIP_SHIFT_CYCLES : VIP_SHIFT_CYCLES;
+		c.movzx(x86::eax, x86::byte_ptr(state, STATE_OFFS(draw_rows)));
+		c.imul(x86::r15d, x86::eax, row_cycles);
+		c.imul(x86::eax, x86::eax, shift_cycles);
+		c.xor_(x86::r9d, x86::r9d);
+		c.test(x86::byte_ptr(state, STATE_OFFS(draw_x)), 7);
+		c.cmovne(x86::r9d, x86::eax);
+		c.add(x86::r15d, x86::r9d);
+		s_var_cost = true;
+	}
 
-		for (u32 p = 0; p < (is_XDRW ? 2 : 1); p++)
+	if (s_cfg.quirks.display_wait)
+	{
+		if (s_cfg.headless || s_cfg.vip_timing)
 		{
-			// Load pixel value
-			c.movzx(x86::r10d, x86::byte_ptr(x86::r8, p));
-			//c.test(x86::r10d, x86::r10d);
-			//c.je(wrap_skip);
-
-			// Temp offset for clamping
-			c.mov(x86::r12d, x86::r9d);
-
-			// Unpack bits into pixels (unrolled loop)
-			for (u32 i = 0; i < 8; i++)
-			{
-				Label next = c.newLabel();
-				c.bt(x86::r10d, 7 - i);
-				c.jnc(next);
-
-				if (is_super)
-				{
-					if (g_state.DRW_wrapping)
-					{
-						c.and_(x86::r12d, x86::r15d);
-					}
-					else
-					{
-						c.test(x86::r12d, x86::r15d);
-						c.jne(next);
-					}
-				}
-				else
-				{
-					if (g_state.DRW_wrapping)
-					{
-						c.and_(x86::r12d, emu_state::xy_mask);
-					}
-					else
-					{
-						c.test(x86::r12d, ~((u32)emu_state::xy_mask));
-						c.jne(next);
-					}
-				}
-
-				c.xor_(x86::byte_ptr(state, x86::r12, 0, STATE_OFFS(gfxMemory) + p * sizeof(u64)), 0xff);
-				c.cmove(x86::r11d, x86::r14d); // Set VF
-				c.bind(next);
-				c.inc(x86::r12d);
-			}
+			// The frame ends with the draw (virtual time: the rest of the frame is idle)
+			s_end_slice = true;
 		}
-
-		c.bind(wrap_skip);
-		!is_XDRW ? c.inc(x86::r8) : c.lea(x86::r8, lea_ptr(x86::r8, 2));
-		c.add(x86::r9, emu_state::y_stride);
-		c.cmp(x86::r8, x86::rdx);
-		c.jne(wrap_loop);
-		c.jmp(skip_size0); // Return to normal instruction epilouge 
-	};
+		else
+		{
+			c.call(imm_ptr(&wait_frame));
+			restore_state(c);
+		}
+	}
 }
 
 void asm_insts::DRW(X86Assembler& c)
@@ -1041,80 +1498,129 @@ void asm_insts::DRW(X86Assembler& c)
 
 void asm_insts::XDRW(X86Assembler& c)
 {
-	if (!g_state.is_super)
+	if (!s_cfg.is_super)
 	{
 		// ???
-		c.jmp(x86::qword_ptr(state, STATE_OFFS(ops) + s_ops::UNK * GET_SIZE_MEM(ops)));
+		jump_to(c, s_ops::UNK);
 	}
 
 	form_DRW<true>(c);
 }
 
-void asm_insts::SKP(X86Assembler& c)
+// Builder for SKP and SKNP: test the held keys mask
+template<bool is_SKP>
+static void form_SKP(X86Assembler& c)
 {
 	getX(c, opcode);
-	c.mov(x86::dl, x86::byte_ptr(state, x86::rdx, 0, STATE_OFFS(gpr)));
-	c.and_(x86::dl, 0xf);
-	c.mov(x86::r8, imm_ptr(&input::keyIDs));
-	c.movzx(args[0].r32(), x86::byte_ptr(x86::r8, x86::rdx, GET_SHIFT_ARR(input::keyIDs)));
-	c.call(imm_ptr(&::GetKeyState));
-	c.mov(state, imm_ptr(&g_state));
-	c.shr(retn.r16(), 16 - 1); // If pressed, contains 1 otherwise 0
+	c.movzx(x86::edx, x86::byte_ptr(state, x86::rdx, 0, STATE_OFFS(gpr)));
+	c.and_(x86::edx, 0xf);
+	c.bt(x86::word_ptr(state, STATE_OFFS(key_state)), x86::dx);
+	is_SKP ? c.setc(retn.r8()) : c.setnc(retn.r8());
 	c.movzx(retn.r32(), retn.r8());
 	c.lea(pc, lea_ptr(pc, retn, 1, 2));
 }
 
+void asm_insts::SKP(X86Assembler& c)
+{
+	form_SKP<true>(c);
+}
+
 void asm_insts::SKNP(X86Assembler& c)
 {
-	getX(c, opcode);
-	c.mov(x86::dl, x86::byte_ptr(state, x86::rdx, 0, STATE_OFFS(gpr)));
-	c.and_(x86::dl, 0xf);
-	c.mov(x86::r8, imm_ptr(&input::keyIDs));
-	c.movzx(args[0].r32(), x86::byte_ptr(x86::r8, x86::rdx, GET_SHIFT_ARR(input::keyIDs)));
-	c.call(imm_ptr(&::GetKeyState));
-	c.mov(state, imm_ptr(&g_state));
-	c.shr(retn.r16(), 16 - 1);
-	c.xor_(retn.r8(), 1);
-	c.movzx(retn.r32(), retn.r8());
-	c.lea(pc, lea_ptr(pc, retn, 1, 2));
+	form_SKP<false>(c);
 }
 
+// Timer fields
+#define TIMER_OFFS(member) (STATE_OFFS(timers) + ::offset_of(&decltype(emu_state::timers)::member))
+
 void asm_insts::GetD(X86Assembler& c)
 {
-	c.mov(x86::r8b, x86::byte_ptr(state, STATE_OFFS(timers) + ::offset_of(&decltype(emu_state::timers)::delay)));
+	if (s_cfg.headless || s_cfg.vip_timing)
+	{
+		// Ticks are frames: value minus the frames elapsed since it was set, down to zero
+		c.mov(retn, x86::qword_ptr(state, STATE_OFFS(frame_count)));
+		c.sub(retn, x86::qword_ptr(state, TIMER_OFFS(delay_tick)));
+		c.movzx(x86::r8d, x86::byte_ptr(state, TIMER_OFFS(delay)));
+		c.xor_(x86::r9d, x86::r9d);
+		c.sub(x86::r8, retn);
+		c.cmovb(x86::r8, x86::r9);
+	}
+	else
+	{
+		c.mov(x86::qword_ptr(x86::rsp, SCRATCH_SLOT), opcode);
+		c.call(imm_ptr(&get_delay_timer));
+		restore_state(c);
+		c.mov(opcode, x86::qword_ptr(x86::rsp, SCRATCH_SLOT));
+		c.mov(x86::r8d, retn.r32());
+	}
+
 	getX(c, opcode);
 	c.mov(x86::byte_ptr(state, x86::rdx, 0, STATE_OFFS(gpr)), x86::r8b);
 }
 
 void asm_insts::GetK(X86Assembler& c)
 {
+	if (s_cfg.headless)
+	{
+		// Take the lowest pressed key, otherwise leave without advancing (FX0A is retried)
+		Label has_key = c.newLabel();
+		c.movzx(x86::r8d, x86::word_ptr(state, STATE_OFFS(key_state)));
+		c.test(x86::r8d, x86::r8d);
+		c.jne(has_key);
+		exit_with(c, exit_reason::key_wait);
+		c.bind(has_key);
+		c.bsf(x86::r8d, x86::r8d);
+		getX(c, opcode);
+		c.mov(x86::byte_ptr(state, x86::rdx, 0, STATE_OFFS(gpr)), x86::r8b);
+		return;
+	}
+
+	c.mov(x86::r12, pc); // Save pc (non-volatile register)
 	c.mov(pc, opcode); // Save rdx
-	c.call(imm_ptr(&input::WaitForPress));
-	c.mov(state, imm_ptr(&g_state));
+	c.call(imm_ptr(&wait_for_key));
+	restore_state(c);
 	getX(c, pc, pc);
 	c.mov(x86::byte_ptr(state, pc, 0, STATE_OFFS(gpr)), retn.r8());
+	c.mov(pc, x86::r12);
 }
 
-void asm_insts::SetD(X86Assembler& c)
+// Builder for FX15 and FX18: set the timer and the tick it counts from
+template <bool is_sound>
+static void form_set_timer(X86Assembler& c)
 {
 	getX(c, opcode);
-	c.mov(x86::r8b, x86::byte_ptr(state, x86::rdx, 0, STATE_OFFS(gpr)));
-	c.mov(x86::byte_ptr(state, STATE_OFFS(timers) + ::offset_of(&decltype(emu_state::timers)::delay)), x86::r8b);
+
+	// Frame-ticked timers are set inline, except the sound timer of windowed instances (set_sound beeps at the sound-on edge)
+	if (s_cfg.headless || (s_cfg.vip_timing && !is_sound))
+	{
+		c.mov(x86::r8b, x86::byte_ptr(state, x86::rdx, 0, STATE_OFFS(gpr)));
+		c.mov(x86::byte_ptr(state, is_sound ? TIMER_OFFS(sound) : TIMER_OFFS(delay)), x86::r8b);
+		c.mov(retn, x86::qword_ptr(state, STATE_OFFS(frame_count)));
+		c.mov(x86::qword_ptr(state, is_sound ? TIMER_OFFS(sound_tick) : TIMER_OFFS(delay_tick)), retn);
+	}
+	else
+	{
+		c.movzx(args[1].r32(), x86::byte_ptr(state, x86::rdx, 0, STATE_OFFS(gpr)));
+		c.call(imm_ptr(is_sound ? &set_sound_timer : &set_delay_timer));
+		restore_state(c);
+	}
+}
+
+void asm_insts::SetD(X86Assembler& c)
+{
+	form_set_timer<false>(c);
 }
 
 void asm_insts::SetS(X86Assembler& c)
 {
-	getX(c, opcode);
-	c.mov(x86::r8b, x86::byte_ptr(state, x86::rdx, 0, STATE_OFFS(gpr)));
-	c.mov(x86::byte_ptr(state, STATE_OFFS(timers) + ::offset_of(&decltype(emu_state::timers)::sound)), x86::r8b);
+	form_set_timer<true>(c);
 }
 
 void asm_insts::AddIndex(X86Assembler& c)
 {
 	getX(c, opcode);
 	c.mov(x86::dl, x86::byte_ptr(state, x86::rdx, 0, STATE_OFFS(gpr)));
-	c.add(x86::edx, x86::dword_ptr(state, STATE_OFFS(index)));
-	c.mov(x86::dword_ptr(state, STATE_OFFS(index)), x86::edx);
+	c.add(x86::word_ptr(state, STATE_OFFS(index)), x86::dx); // Wraps at 16 bits (index_mask), upper half is always zero
 }
 
 void asm_insts::SetCh(X86Assembler& c)
@@ -1136,7 +1642,7 @@ void asm_insts::STD(X86Assembler& c)
 	c.mov(x86::dl, 100);
 	c.div(x86::dl);
 	c.mov(x86::r8d, x86::dword_ptr(state, STATE_OFFS(index)));
-	c.lea(x86::r8, lea_ptr(state, x86::r8, 0, STATE_OFFS(memBase)));
+	c.add(x86::r8, mem);
 	c.mov(x86::byte_ptr(x86::r8, 0), x86::al);
 	c.shr(x86::eax, 8); // Move back reminder
 	c.mov(x86::dl, 10);
@@ -1146,43 +1652,70 @@ void asm_insts::STD(X86Assembler& c)
 	c.mov(x86::byte_ptr(x86::r8, 2), x86::al);
 }
 
-void asm_insts::STR(X86Assembler& c)
+// Builder for FX55 and FX65: move the first X+1 registers from/to memory
+// The view always has 16 accessible bytes past index, so whole 16 byte blocks are accessed and merged
+template <bool is_store>
+static void form_block_move(X86Assembler& c)
 {
 	getX(c, opcode);
-	c.inc(opcode.r8());
-	c.mov(x86::r8, state); // Save state
-	c.mov(x86::ecx, opcode.r32());
-	c.mov(x86::edi, x86::dword_ptr(x86::r8, STATE_OFFS(index)));
-	c.lea(x86::rdi, lea_ptr(x86::r8, x86::rdi, 0, STATE_OFFS(memBase)));
-	c.lea(x86::rsi, lea_ptr(x86::r8, STATE_OFFS(gpr)));
-	c.rep().movsb();
-	c.mov(state, x86::r8);
-	if (g_state.is_super)
-		c.and_(opcode.r32(), x86::dword_ptr(state, STATE_OFFS(compatibilty))); // Zero out if compat flag is false
-	c.add(x86::dword_ptr(state, STATE_OFFS(index)), opcode.r32());
+	c.inc(opcode.r8()); // Registers count
+	c.mov(x86::r8d, x86::dword_ptr(state, STATE_OFFS(index)));
+	c.add(x86::r8, mem);
+
+	const X86Mem regs = x86::oword_ptr(state, STATE_OFFS(gpr));
+	const X86Mem ram = x86::oword_ptr(x86::r8);
+
+	if (::get_cpu_features().level >= isa_level::avx512)
+	{
+		// Masked store only touches the selected bytes
+		c.mov(x86::r9d, -1);
+		c.bzhi(x86::r9d, x86::r9d, opcode.r32());
+		c.kmovw(x86::k1, x86::r9d);
+		c.vmovdqu8(x86::xmm0, is_store ? regs : ram);
+		c.k(x86::k1).vmovdqu8(is_store ? ram : regs, x86::xmm0);
+	}
+	else
+	{
+		// Blend with the bytes mask of the count
+		c.mov(x86::r9d, opcode.r32());
+		c.shl(x86::r9d, 4);
+		c.mov(retn, imm_ptr(s_byte_masks.data()));
+		c.movdqa(x86::xmm2, x86::oword_ptr(retn, x86::r9));
+		c.movdqu(x86::xmm0, is_store ? regs : ram);
+		c.movdqu(x86::xmm1, is_store ? ram : regs);
+		c.pand(x86::xmm0, x86::xmm2);
+		c.pandn(x86::xmm2, x86::xmm1);
+		c.por(x86::xmm0, x86::xmm2);
+		c.movdqu(is_store ? ram : regs, x86::xmm0);
+	}
+
+	if (s_cfg.quirks.index_increment)
+	{
+		c.add(x86::word_ptr(state, STATE_OFFS(index)), opcode.r16());
+	}
+
+	if (s_cfg.vip_timing)
+	{
+		c.imul(x86::r15d, opcode.r32(), VIP_MOVE_CYCLES);
+		s_var_cost = true;
+	}
+}
+
+void asm_insts::STR(X86Assembler& c)
+{
+	form_block_move<true>(c);
 }
 
 void asm_insts::LDR(X86Assembler& c)
 {
-	getX(c, opcode);
-	c.inc(opcode.r8());
-	c.mov(x86::r8, state);
-	c.mov(x86::ecx, opcode.r32());
-	c.mov(x86::esi, x86::dword_ptr(x86::r8, STATE_OFFS(index)));
-	c.lea(x86::rsi, lea_ptr(x86::r8, x86::rsi, 0, STATE_OFFS(memBase)));
-	c.lea(x86::rdi, lea_ptr(x86::r8, STATE_OFFS(gpr)));
-	c.rep().movsb();
-	c.mov(state, x86::r8);
-	if (g_state.is_super)
-		c.and_(opcode.r32(), x86::dword_ptr(state, STATE_OFFS(compatibilty))); // Zero out if compat flag is false
-	c.add(x86::dword_ptr(state, STATE_OFFS(index)), opcode.r32());
+	form_block_move<false>(c);
 }
 
 void asm_insts::FSAVE(X86Assembler& c)
 {
-	if (!g_state.is_super)
+	if (!s_cfg.is_super)
 	{
-		c.jmp(x86::qword_ptr(state, STATE_OFFS(ops) + s_ops::UNK * GET_SIZE_MEM(ops)));
+		jump_to(c, s_ops::UNK);
 	}
 
 	getX(c, opcode);
@@ -1197,9 +1730,9 @@ void asm_insts::FSAVE(X86Assembler& c)
 
 void asm_insts::FRESTORE(X86Assembler& c)
 {
-	if (!g_state.is_super)
+	if (!s_cfg.is_super)
 	{
-		c.jmp(x86::qword_ptr(state, STATE_OFFS(ops) + s_ops::UNK * GET_SIZE_MEM(ops)));
+		jump_to(c, s_ops::UNK);
 	}
 
 	getX(c, opcode);
@@ -1214,11 +1747,7 @@ void asm_insts::FRESTORE(X86Assembler& c)
 
 void asm_insts::UNK(X86Assembler& c)
 {
-	c.mov(x86::r8, imm_ptr("Unknown instruction"));
-	c.mov(x86::qword_ptr(state, STATE_OFFS(last_error)), x86::r8);
-	c.mov(x86::r8, imm_ptr(&asm_insts::entry));
-	c.mov(x86::r8, x86::qword_ptr(x86::r8));
-	c.jmp(x86::r8);
+	exit_with(c, exit_reason::unknown_instruction, "Unknown instruction");
 }
 
 void asm_insts::guard(X86Assembler& c)
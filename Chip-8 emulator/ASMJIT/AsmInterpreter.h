@@ -1,16 +1,28 @@
 #pragma once
 #include "asmutils.h"
 #include "../utils.h"
+#include "../quirks.h"
 
 #include <initializer_list>
 
+struct emu_state;
+
 struct asm_insts
 {
 public:
 	// Entry function
-	static void(*entry)();
+	static void(*entry)(emu_state*);
 	static decltype(entry) build_entry();
 
+	// Settings the generated code is specialized for (code is shared between equal configs)
+	struct config_t
+	{
+		bool is_super;
+		bool headless;
+		bool vip_timing;
+		quirk_profile quirks;
+	};
+
 	// Instruction builder type
 	using build_t = void(asmjit::X86Assembler&);
 	// Intruction function pointer type
@@ -22,17 +34,22 @@ public:
 		const u16 opcode;
 		const bool is_jump;
 		std::add_pointer_t<build_t> builder;
+		// COSMAC VIP machine cycles (fixed part, DRW and FX55/FX65 add a variable part)
+		const u16 cycles;
 	};
 
 	static const std::initializer_list<inst_entry> all_ops;
 
-	static void build_all(std::uintptr_t* table);
+	// Returns the table of the config (built once, shared by all instances)
+	static const std::uintptr_t* build_all(const config_t& cfg);
+	static void build_table(std::uintptr_t* table);
 
 	static build_t RET;
 	static build_t CLS;
 	static build_t Compat;
 	static build_t SCR;
 	static build_t SCL;
+	static build_t SCD;
 	static build_t RESL;
 	static build_t RESH;
 	static build_t JP;
@@ -0,0 +1,332 @@
+#include "archive.h"
+#include "emucore.h"
+#include "snapshot.h"
+
+#include <algorithm>
+#include <cstring>
+
+// File layout:
+// Header: "C8FA", version, keyframe interval (u32 each)
+// Records: a tag byte, then a u32 count (repeat) or the run-length encoded delta (delta, keyframe)
+// Index: (frame number, offset) of every keyframe (u64 each)
+// Footer: index offset, keyframes count, frames count (u64 each), "C8FI"
+static constexpr char s_magic[4] = { 'C', '8', 'F', 'A' };
+static constexpr char s_index_magic[4] = { 'C', '8', 'F', 'I' };
+static constexpr u32 s_version = 1;
+
+enum record_tag : u8
+{
+	tag_repeat = 0, // The previous frame repeats 'count' times
+	tag_delta = 1,
+	tag_keyframe = 2,
+	tag_kind_mask = 3,
+	tag_extended = 4, // Frame is in extended mode (delta, keyframe)
+};
+
+struct archive_footer
+{
+	u64 index_offset;
+	u64 keyframes;
+	u64 frames;
+	char magic[4];
+};
+
+// Transpose a 16x16 byte matrix (4 rounds of interleaving rows i and i + 8)
+static void transpose16(__m128i (&rows)[16])
+{
+	for (u32 round = 0; round < 4; round++)
+	{
+		__m128i out[16];
+
+		for (u32 i = 0; i < 8; i++)
+		{
+			out[i * 2] = _mm_unpacklo_epi8(rows[i], rows[i + 8]);
+			out[i * 2 + 1] = _mm_unpackhi_epi8(rows[i], rows[i + 8]);
+		}
+
+		std::memcpy(rows, out, sizeof(out));
+	}
+}
+
+// Packed lines to 16 byte columns of 64 lines
+static void pack_columns(const u64 (*lines)[2], u8* columns)
+{
+	for (u32 block = 0; block < 4; block++)
+	{
+		__m128i rows[16];
+
+		for (u32 i = 0; i < 16; i++)
+		{
+			rows[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(lines[block * 16 + i]));
+		}
+
+		transpose16(rows);
+
+		for (u32 c = 0; c < 16; c++)
+		{
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(columns + c * 64 + block * 16), rows[c]);
+		}
+	}
+}
+
+static void unpack_columns(const u8* columns, u64 (*lines)[2])
+{
+	for (u32 block = 0; block < 4; block++)
+	{
+		__m128i rows[16];
+
+		for (u32 c = 0; c < 16; c++)
+		{
+			rows[c] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(columns + c * 64 + block * 16));
+		}
+
+		transpose16(rows);
+
+		for (u32 i = 0; i < 16; i++)
+		{
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(lines[block * 16 + i]), rows[i]);
+		}
+	}
+}
+
+frame_archive_writer::frame_archive_writer(const std::string& path, u32 keyframe_interval)
+	: m_interval(std::max<u32>(keyframe_interval, 1))
+{
+	m_file = std::fopen(path.c_str(), "wb");
+
+	if (m_file)
+	{
+		const u32 header[3] = { bitcast<u32>(s_magic), s_version, m_interval };
+		write(header, sizeof(header));
+	}
+}
+
+frame_archive_writer::~frame_archive_writer()
+{
+	close();
+}
+
+void frame_archive_writer::write(const void* data, size_t size)
+{
+	if (m_file && !m_failed && std::fwrite(data, 1, size, m_file) != size)
+	{
+		m_failed = true;
+	}
+
+	m_offset += size;
+}
+
+void frame_archive_writer::flush_repeats()
+{
+	if (m_repeats)
+	{
+		const u8 tag = tag_repeat;
+		write(&tag, 1);
+		write(&m_repeats, sizeof(m_repeats));
+		m_repeats = 0;
+	}
+}
+
+void frame_archive_writer::add(const emu_state& state)
+{
+	u64 lines[emu_state::y_size_ex][2];
+	state.copy_framebuffer(lines);
+	add(lines, state.extended);
+}
+
+void frame_archive_writer::add(const u64 (*lines)[2], bool extended)
+{
+	if (!m_file)
+	{
+		return;
+	}
+
+	alignas(16) u8 columns[1024];
+	pack_columns(lines, columns);
+
+	const bool keyframe = m_frames % m_interval == 0;
+
+	if (!keyframe && extended == m_last_extended && !std::memcmp(columns, m_last, sizeof(columns)))
+	{
+		m_repeats++;
+		m_frames++;
+		return;
+	}
+
+	flush_repeats();
+
+	if (keyframe)
+	{
+		m_index.emplace_back(m_frames, m_offset);
+	}
+
+	m_buffer.clear();
+	m_buffer.push_back((keyframe ? tag_keyframe : tag_delta) | (extended ? tag_extended : 0));
+	rle_encode(columns, keyframe ? nullptr : m_last, sizeof(columns), m_buffer);
+	write(m_buffer.data(), m_buffer.size());
+
+	std::memcpy(m_last, columns, sizeof(columns));
+	m_last_extended = extended;
+	m_frames++;
+}
+
+bool frame_archive_writer::close()
+{
+	if (!m_file)
+	{
+		return false;
+	}
+
+	flush_repeats();
+
+	archive_footer footer{ m_offset, m_index.size(), m_frames, {} };
+	std::memcpy(footer.magic, s_index_magic, sizeof(s_index_magic));
+
+	for (const auto& entry : m_index)
+	{
+		const u64 pair[2] = { entry.first, entry.second };
+		write(pair, sizeof(pair));
+	}
+
+	write(&footer, sizeof(footer));
+
+	if (std::fclose(m_file))
+	{
+		m_failed = true;
+	}
+
+	m_file = nullptr;
+	return !m_failed;
+}
+
+bool frame_archive_reader::open(const std::string& path)
+{
+	m_file = std::fopen(path.c_str(), "rb");
+
+	u32 header[3];
+	archive_footer footer;
+
+	if (!m_file
+		|| std::fread(header, sizeof(header), 1, m_file) != 1
+		|| header[0] != bitcast<u32>(s_magic)
+		|| header[1] != s_version
+		|| _fseeki64(m_file, -static_cast<s64>(sizeof(footer)), SEEK_END)
+		|| std::fread(&footer, sizeof(footer), 1, m_file) != 1
+		|| std::memcmp(footer.magic, s_index_magic, sizeof(s_index_magic))
+		|| footer.keyframes > footer.frames
+		|| _fseeki64(m_file, footer.index_offset, SEEK_SET))
+	{
+		return false;
+	}
+
+	m_index.resize(footer.keyframes);
+
+	for (auto& entry : m_index)
+	{
+		u64 pair[2];
+
+		if (std::fread(pair, sizeof(pair), 1, m_file) != 1)
+		{
+			return false;
+		}
+
+		entry = { pair[0], pair[1] };
+	}
+
+	m_frames = footer.frames;
+	m_index_offset = footer.index_offset;
+	return true;
+}
+
+frame_archive_reader::~frame_archive_reader()
+{
+	if (m_file)
+	{
+		std::fclose(m_file);
+	}
+}
+
+bool frame_archive_reader::read(u64 n, u64 (*lines)[2], bool& extended)
+{
+	if (n >= m_frames)
+	{
+		return false;
+	}
+
+	// Last keyframe at or before the frame, its records end at the next keyframe
+	const auto key = std::upper_bound(m_index.begin(), m_index.end(), n, [](u64 frame, const std::pair<u64, u64>& entry)
+	{
+		return frame < entry.first;
+	});
+
+	if (key == m_index.begin())
+	{
+		return false;
+	}
+
+	const u64 start = std::prev(key)->second;
+	const u64 end = key == m_index.end() ? m_index_offset : key->second;
+
+	if (end < start || _fseeki64(m_file, start, SEEK_SET))
+	{
+		return false;
+	}
+
+	m_buffer.resize(end - start);
+
+	if (std::fread(m_buffer.data(), 1, m_buffer.size(), m_file) != m_buffer.size())
+	{
+		return false;
+	}
+
+	alignas(16) u8 columns[1024]{};
+	const u8* in = m_buffer.data();
+	const u8* const in_end = in + m_buffer.size();
+
+	// Apply records until the frame is reached ('next' is the frame the next record starts at)
+	bool found = false;
+
+	for (u64 next = std::prev(key)->first; !found && in < in_end;)
+	{
+		const u8 tag = *in++;
+
+		if ((tag & tag_kind_mask) == tag_repeat)
+		{
+			u32 count;
+
+			if (in_end - in < 4)
+			{
+				return false;
+			}
+
+			std::memcpy(&count, in, sizeof(count));
+			in += sizeof(count);
+
+			// Repeats of the frame decoded last
+			found = n < next + count;
+			next += count;
+			continue;
+		}
+
+		if ((tag & tag_kind_mask) == tag_keyframe)
+		{
+			std::memset(columns, 0, sizeof(columns));
+		}
+
+		if (!(in = rle_decode(in, in_end, columns, sizeof(columns))))
+		{
+			return false;
+		}
+
+		extended = (tag & tag_extended) != 0;
+		found = next++ == n;
+	}
+
+	if (!found)
+	{
+		return false;
+	}
+
+	unpack_columns(columns, lines);
+	return true;
+}
@@ -0,0 +1,90 @@
+#pragma once
+#include "utils.h"
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+struct emu_state;
+
+// Lossless archive of every frame of a run
+// A frame is stored as the XOR delta against the previous one, run-length encoded (see rle_encode), unchanged frames as a repeat count
+// Frames are transposed to byte columns of 64 lines first, so a sprite moving is one run per column instead of one per line
+// Every 'keyframe_interval' frames a keyframe is encoded against a blank screen, an index of them at the end of the file allows to
+// decode any frame from the keyframe before it
+class frame_archive_writer
+{
+public:
+	frame_archive_writer(const std::string& path, u32 keyframe_interval = 600);
+	~frame_archive_writer();
+
+	// False if the file could not be opened or written
+	bool ok() const
+	{
+		return m_file && !m_failed;
+	}
+
+	// Append the current frame
+	void add(const emu_state& state);
+
+	// Append a frame given as packed lines (see emu_state::copy_framebuffer)
+	void add(const u64 (*lines)[2], bool extended);
+
+	// Write the index and close the file, called by the destructor
+	bool close();
+
+	u64 frames() const
+	{
+		return m_frames;
+	}
+
+	// Bytes written so far
+	u64 size() const
+	{
+		return m_offset;
+	}
+
+private:
+	void write(const void* data, size_t size);
+	void flush_repeats();
+
+	std::FILE* m_file = nullptr;
+	bool m_failed = false;
+	u32 m_interval;
+	u64 m_frames = 0;
+	u64 m_offset = 0;
+
+	// Previous frame (transposed)
+	alignas(16) u8 m_last[1024]{};
+	bool m_last_extended = false;
+
+	// Frames equal to the previous one not written yet
+	u32 m_repeats = 0;
+
+	// Keyframes (frame number, file offset)
+	std::vector<std::pair<u64, u64>> m_index;
+	std::vector<u8> m_buffer;
+};
+
+class frame_archive_reader
+{
+public:
+	// Reads the header and the index, returns false if the file is not an archive
+	bool open(const std::string& path);
+	~frame_archive_reader();
+
+	u64 frames() const
+	{
+		return m_frames;
+	}
+
+	// Decode frame 'n' as packed lines (see emu_state::copy_framebuffer), returns false if out of range or malformed
+	bool read(u64 n, u64 (*lines)[2], bool& extended);
+
+private:
+	std::FILE* m_file = nullptr;
+	u64 m_frames = 0;
+	u64 m_index_offset = 0;
+	std::vector<std::pair<u64, u64>> m_index;
+	std::vector<u8> m_buffer;
+};
@@ -0,0 +1,600 @@
+// Chip-8 batch runner
+// Runs every combination of roms, input scripts and seeds headless on all cores
+//
+#include "emucore.h"
+#include "archive.h"
+#include "capture.h"
+#include "softrender.h"
+#include "workqueue.h"
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <algorithm>
+#include <string_view>
+#include <optional>
+
+namespace fs = std::filesystem;
+
+// Scripted input: keys mask held from the specified frame onward
+struct input_event
+{
+	u64 frame;
+	u16 keys;
+};
+
+struct rom_image
+{
+	std::string path;
+	std::vector<u8> data;
+	// Shared by all jobs of the rom (copy-on-write)
+	std::shared_ptr<guest_image> image;
+	bool is_super;
+	quirk_profile quirks;
+};
+
+struct input_script
+{
+	std::string path;
+	std::vector<input_event> events;
+};
+
+struct batch_job
+{
+	size_t id;
+	size_t rom;
+	size_t script;
+	u32 seed;
+};
+
+struct job_result
+{
+	std::string reason;
+	std::string error;
+	u64 insts = 0;
+	u64 frames = 0;
+	u64 fb_hash = 0;
+	f64 ms = 0;
+
+	// Video capture: frames queued and dropped, time spent queuing them on the emulation thread
+	u64 captured = 0;
+	u64 dropped = 0;
+	f64 capture_ms = 0;
+	bool capture_failed = false;
+
+	// Frame archive size in bytes (zero if it could not be written)
+	u64 archive_size = 0;
+
+	// Software render benchmark, per scale factor (index 0: scale 1)
+	u64 render_pixels[max_render_scale]{};
+	f64 render_ms[max_render_scale]{};
+};
+
+// Renders of the final frame per scale factor in the software render benchmark
+static constexpr u32 s_render_repeats = 64;
+
+struct batch_settings
+{
+	u64 max_frames = 60 * 60;
+	u32 inst_per_frame = 15;
+	size_t threads = 0;
+	u32 instances = 1;
+	bool force_super = false;
+	bool vip_timing = false;
+	bool render_bench = false;
+	const char* output = nullptr;
+	const char* capture_dir = nullptr;
+	capture_format capture_as = capture_format::y4m;
+	u32 capture_scale = 1;
+	const char* archive_dir = nullptr;
+};
+
+static void usage()
+{
+	std::printf(
+		"Usage: chip8-batch [options] <rom|@list>...\n"
+		"  -s <file>   input script (repeatable, default: no input)\n"
+		"  -r <seed>   RND seed (repeatable, default: 1)\n"
+		"  -f <count>  frames budget per job (default: 3600)\n"
+		"  -i <count>  instructions per frame (default: 15)\n"
+		"  -j <count>  worker threads (default: all cores)\n"
+		"  -n <count>  instances per job, run interleaved frame by frame like hosted sessions (cache footprint benchmark, default: 1)\n"
+		"  -o <file>   write results to file instead of stdout\n"
+		"  -q <name>   quirk profile of the roms that follow (vip, chip8, schip, default: by image kind)\n"
+		"  -S          treat all roms as super chip-8 images\n"
+		"  -V          COSMAC VIP timing: instructions are charged their VIP cycles, frames are 1/60s of VIP time (-i is ignored)\n"
+		"  -R          software render benchmark: render the final frame of each job to RGBA at every scale factor\n"
+		"  -c <dir>    record every frame of each job to <dir>/<job>.y4m\n"
+		"  -P          record PNG files (<dir>/<job>-<frame>.png) instead\n"
+		"  -x <scale>  scale of the recorded frames (1-8, default: 1)\n"
+		"  -a <dir>    archive every frame of each job losslessly to <dir>/<job>.c8fa\n");
+}
+
+static bool read_file(const std::string& path, std::vector<u8>& out)
+{
+	std::ifstream file(path, std::ifstream::binary);
+
+	if (!file)
+	{
+		return false;
+	}
+
+	out.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	return true;
+}
+
+// Quoted CSV field, embedded quotes are doubled (RFC 4180)
+static std::string csv_field(std::string_view text)
+{
+	std::string out = "\"";
+
+	for (const char c : text)
+	{
+		out += c;
+
+		if (c == '"')
+		{
+			out += '"';
+		}
+	}
+
+	return out += '"';
+}
+
+// Script format: one "<frame> <keys mask in hex>" pair per line, '#' starts a comment
+static bool read_script(const std::string& path, input_script& out)
+{
+	std::ifstream file(path);
+
+	if (!file)
+	{
+		return false;
+	}
+
+	out.path = path;
+
+	for (std::string line; std::getline(file, line);)
+	{
+		line = line.substr(0, line.find('#'));
+
+		unsigned long long frame;
+		unsigned keys;
+
+		if (std::sscanf(line.c_str(), "%llu %x", &frame, &keys) == 2)
+		{
+			out.events.push_back({ frame, static_cast<u16>(keys) });
+		}
+	}
+
+	std::stable_sort(out.events.begin(), out.events.end(), [](const input_event& a, const input_event& b)
+	{
+		return a.frame < b.frame;
+	});
+
+	return true;
+}
+
+// The first state is the one reported, the others run copies of the job in lockstep (-n)
+static void run_job(const std::vector<std::unique_ptr<emu_state>>& states, const rom_image& rom, const input_script* script, const batch_job& job, const batch_settings& settings, job_result& result)
+{
+	const auto start = std::chrono::steady_clock::now();
+	emu_state& state = *states[0];
+
+	for (const auto& instance : states)
+	{
+		instance->is_super = rom.is_super;
+		instance->quirks = rom.quirks;
+		instance->headless = true;
+		instance->vip_timing = settings.vip_timing;
+		instance->reset(rom.image);
+		instance->seed_random(job.seed);
+	}
+
+	std::unique_ptr<video_capture> capture;
+
+	if (settings.capture_dir)
+	{
+		const std::string name = std::to_string(job.id) + (settings.capture_as == capture_format::png ? "-" : ".y4m");
+		capture = std::make_unique<video_capture>((fs::path(settings.capture_dir) / name).string(), settings.capture_as, settings.capture_scale);
+	}
+
+	std::unique_ptr<frame_archive_writer> archive;
+
+	if (settings.archive_dir)
+	{
+		archive = std::make_unique<frame_archive_writer>((fs::path(settings.archive_dir) / (std::to_string(job.id) + ".c8fa")).string());
+	}
+
+	size_t next_event = 0;
+	exit_reason reason = exit_reason::none;
+
+	while (state.frame_count < settings.max_frames)
+	{
+		// Input is sampled at frame boundaries
+		while (script && next_event < script->events.size() && script->events[next_event].frame <= state.frame_count)
+		{
+			for (const auto& instance : states)
+			{
+				instance->key_state = script->events[next_event].keys;
+			}
+
+			next_event++;
+		}
+
+		reason = state.run_frame(settings.inst_per_frame);
+
+		// Copies are deterministic, they end with the first state
+		for (size_t i = 1; i < states.size(); i++)
+		{
+			states[i]->run_frame(settings.inst_per_frame);
+		}
+
+		if (archive)
+		{
+			archive->add(state);
+		}
+
+		if (capture)
+		{
+			// Presentation point, the frame is queued to the encoder
+			const auto capture_start = std::chrono::steady_clock::now();
+			capture->capture(state);
+			result.capture_ms += std::chrono::duration<f64, std::milli>(std::chrono::steady_clock::now() - capture_start).count();
+		}
+
+		if (reason != exit_reason::none && reason != exit_reason::key_wait)
+		{
+			break;
+		}
+	}
+
+	const bool out_of_frames = reason == exit_reason::none || reason == exit_reason::key_wait;
+
+	result.reason = out_of_frames ? "budget" : exit_reason_name(reason);
+	// Only unknown instructions and stack errors set a message
+	const bool error = reason == exit_reason::unknown_instruction || reason == exit_reason::stack_overflow || reason == exit_reason::stack_underflow;
+	result.error = error ? state.last_error : "";
+	result.insts = state.inst_count;
+	result.frames = state.frame_count;
+	result.fb_hash = state.framebuffer_hash();
+	result.ms = std::chrono::duration<f64, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	if (archive && archive->close())
+	{
+		result.archive_size = archive->size();
+	}
+
+	if (capture)
+	{
+		// Waits for the encoder, not part of the job's time
+		capture->finish();
+		result.captured = capture->captured();
+		result.dropped = capture->dropped();
+		result.capture_failed = !capture->ok();
+	}
+
+	if (settings.render_bench)
+	{
+		// Allocate the largest image first, it is reused by all renders
+		rgba_frame frame;
+		frame.render(state, max_render_scale);
+
+		for (u32 scale = 1; scale <= max_render_scale; scale++)
+		{
+			const auto render_start = std::chrono::steady_clock::now();
+
+			for (u32 i = 0; i < s_render_repeats; i++)
+			{
+				frame.render(state, scale);
+			}
+
+			result.render_ms[scale - 1] = std::chrono::duration<f64, std::milli>(std::chrono::steady_clock::now() - render_start).count();
+			result.render_pixels[scale - 1] = u64{s_render_repeats} * frame.pixels.size();
+		}
+	}
+}
+
+int main(int argc, char** argv)
+{
+	batch_settings settings;
+	std::vector<rom_image> roms;
+	std::vector<input_script> scripts;
+	std::vector<u32> seeds;
+	std::vector<std::string> rom_paths;
+
+	// Quirk profile selected for each rom path (none: by image kind)
+	std::vector<std::optional<quirk_profile>> rom_quirks;
+	std::optional<quirk_profile> quirks;
+
+	for (int i = 1; i < argc; i++)
+	{
+		const std::string arg = argv[i];
+
+		// Options with a value
+		if (arg.size() == 2 && arg[0] == '-' && std::string_view("srfijnoqcxa").find(arg[1]) != std::string_view::npos)
+		{
+			if (i + 1 >= argc)
+			{
+				usage();
+				return 1;
+			}
+
+			const char* value = argv[++i];
+
+			switch (arg[1])
+			{
+			case 's':
+			{
+				input_script script;
+
+				if (!read_script(value, script))
+				{
+					std::fprintf(stderr, "Failed to read input script: %s\n", value);
+					return 1;
+				}
+
+				scripts.emplace_back(std::move(script));
+				break;
+			}
+			case 'r': seeds.push_back(static_cast<u32>(std::strtoul(value, nullptr, 0))); break;
+			case 'f': settings.max_frames = std::strtoull(value, nullptr, 0); break;
+			case 'i': settings.inst_per_frame = std::max<u32>(1, static_cast<u32>(std::strtoul(value, nullptr, 0))); break;
+			case 'j': settings.threads = std::strtoul(value, nullptr, 0); break;
+			case 'n': settings.instances = std::max<u32>(1, static_cast<u32>(std::strtoul(value, nullptr, 0))); break;
+			case 'o': settings.output = value; break;
+			case 'c': settings.capture_dir = value; break;
+			case 'a': settings.archive_dir = value; break;
+			case 'x': settings.capture_scale = std::clamp<u32>(static_cast<u32>(std::strtoul(value, nullptr, 0)), 1, max_render_scale / 2); break;
+			case 'q':
+			{
+				quirk_profile profile;
+
+				if (!quirk_profile::find(value, profile))
+				{
+					std::fprintf(stderr, "Unknown quirk profile: %s\n", value);
+					return 1;
+				}
+
+				quirks = profile;
+				break;
+			}
+			}
+		}
+		else if (arg == "-S")
+		{
+			settings.force_super = true;
+		}
+		else if (arg == "-V")
+		{
+			settings.vip_timing = true;
+		}
+		else if (arg == "-R")
+		{
+			settings.render_bench = true;
+		}
+		else if (arg == "-P")
+		{
+			settings.capture_as = capture_format::png;
+		}
+		else if (arg[0] == '@')
+		{
+			// List file, one rom path per line
+			std::ifstream list(arg.substr(1));
+
+			for (std::string line; std::getline(list, line);)
+			{
+				if (!line.empty() && line[0] != '#')
+				{
+					rom_paths.emplace_back(line);
+					rom_quirks.emplace_back(quirks);
+				}
+			}
+		}
+		else if (arg[0] == '-')
+		{
+			usage();
+			return 1;
+		}
+		else
+		{
+			rom_paths.emplace_back(arg);
+			rom_quirks.emplace_back(quirks);
+		}
+	}
+
+	if (rom_paths.empty())
+	{
+		usage();
+		return 1;
+	}
+
+	for (size_t i = 0; i < rom_paths.size(); i++)
+	{
+		const auto& path = rom_paths[i];
+		rom_image rom;
+		rom.path = path;
+
+		if (!read_file(path, rom.data) || rom.data.empty() || !(rom.image = guest_image::create(rom.data.data(), rom.data.size())))
+		{
+			std::fprintf(stderr, "Failed to load rom: %s\n", path.c_str());
+			return 1;
+		}
+
+		// Super images are placed in a "super" directory (see README.md)
+		rom.is_super = settings.force_super || fs::path(path).parent_path().filename() == "super";
+		rom.quirks = rom_quirks[i].value_or(rom.is_super ? quirk_profile::schip() : quirk_profile::chip8());
+		roms.emplace_back(std::move(rom));
+	}
+
+	if (seeds.empty())
+	{
+		seeds.push_back(1);
+	}
+
+	// Jobs without a script run with no input at all
+	const size_t script_count = std::max<size_t>(scripts.size(), 1);
+
+	if (!settings.threads)
+	{
+		settings.threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+	}
+
+	work_stealing_queue<batch_job> queue(settings.threads);
+	std::vector<job_result> results(roms.size() * script_count * seeds.size());
+
+	// Deal jobs round-robin, stealing balances out short and long roms
+	size_t id = 0;
+	for (size_t r = 0; r < roms.size(); r++)
+	{
+		for (size_t s = 0; s < script_count; s++)
+		{
+			for (u32 seed : seeds)
+			{
+				queue.push(id, { id, r, s, seed });
+				id++;
+			}
+		}
+	}
+
+	std::vector<std::thread> workers;
+	const auto start = std::chrono::steady_clock::now();
+
+	for (size_t w = 0; w < settings.threads; w++)
+	{
+		workers.emplace_back([&, w]()
+		{
+			// States of the worker, reused by all of its jobs
+			std::vector<std::unique_ptr<emu_state>> states(settings.instances);
+
+			for (auto& state : states)
+			{
+				state = std::make_unique<emu_state>();
+			}
+
+			for (batch_job job; queue.pop(w, job);)
+			{
+				run_job(states, roms[job.rom], scripts.empty() ? nullptr : &scripts[job.script], job, settings, results[job.id]);
+			}
+		});
+	}
+
+	for (auto& worker : workers)
+	{
+		worker.join();
+	}
+
+	// Throughput summary (benchmark mode: many jobs, compare runs)
+	const f64 seconds = std::chrono::duration<f64>(std::chrono::steady_clock::now() - start).count();
+	u64 total_insts = 0;
+
+	for (const auto& res : results)
+	{
+		total_insts += res.insts * settings.instances;
+	}
+
+	std::fprintf(stderr, "%zu jobs x %u instances, %zu threads, isa %s, %llu instructions in %.3fs (%.2f MIPS, %.2f ns per instruction per thread), %zu bytes per instance\n"
+		, results.size()
+		, settings.instances
+		, settings.threads
+		, isa_level_name(get_cpu_features().level)
+		, static_cast<unsigned long long>(total_insts)
+		, seconds
+		, seconds > 0 ? total_insts / seconds / 1e6 : 0.
+		, total_insts ? seconds * std::min(settings.threads, results.size()) * 1e9 / total_insts : 0.
+		, sizeof(emu_state));
+
+	if (settings.capture_dir)
+	{
+		u64 captured = 0, dropped = 0, failed = 0;
+		f64 capture_ms = 0, ms = 0;
+
+		for (const auto& res : results)
+		{
+			captured += res.captured;
+			dropped += res.dropped;
+			failed += res.capture_failed;
+			capture_ms += res.capture_ms;
+			ms += res.ms;
+		}
+
+		std::fprintf(stderr, "capture: %llu frames, %llu dropped, %llu jobs failed to write, %.2f%% of job time spent queuing frames\n"
+			, static_cast<unsigned long long>(captured)
+			, static_cast<unsigned long long>(dropped)
+			, static_cast<unsigned long long>(failed)
+			, ms > 0 ? capture_ms / ms * 100 : 0.);
+	}
+
+	if (settings.archive_dir)
+	{
+		u64 bytes = 0, frames = 0, failed = 0;
+
+		for (const auto& res : results)
+		{
+			bytes += res.archive_size;
+			frames += res.archive_size ? res.frames : 0;
+			failed += !res.archive_size;
+		}
+
+		std::fprintf(stderr, "archive: %llu frames in %llu bytes (%.2f bytes per frame), %llu jobs failed to write\n"
+			, static_cast<unsigned long long>(frames)
+			, static_cast<unsigned long long>(bytes)
+			, frames ? static_cast<f64>(bytes) / frames : 0.
+			, static_cast<unsigned long long>(failed));
+	}
+
+	if (settings.render_bench)
+	{
+		// Single thread rates, summed over all jobs
+		for (u32 scale = 1; scale <= max_render_scale; scale++)
+		{
+			u64 pixels = 0;
+			f64 ms = 0;
+
+			for (const auto& res : results)
+			{
+				pixels += res.render_pixels[scale - 1];
+				ms += res.render_ms[scale - 1];
+			}
+
+			std::fprintf(stderr, "software render x%-2u: %.1f Mpixels/s per thread\n", scale, ms > 0 ? pixels / ms / 1e3 : 0.);
+		}
+	}
+
+	std::FILE* out = settings.output ? std::fopen(settings.output, "w") : stdout;
+
+	if (!out)
+	{
+		std::fprintf(stderr, "Failed to open output file: %s\n", settings.output);
+		return 1;
+	}
+
+	// Results in job order regardless of scheduling
+	std::fprintf(out, "rom,script,seed,exit,error,instructions,frames,fb_hash,ms\n");
+
+	for (id = 0; id < results.size(); id++)
+	{
+		const size_t seed_index = id % seeds.size();
+		const size_t script_index = (id / seeds.size()) % script_count;
+		const size_t rom_index = id / (seeds.size() * script_count);
+		const auto& res = results[id];
+
+		std::fprintf(out, "%s,%s,%u,%s,%s,%llu,%llu,%016llx,%.3f\n"
+			, csv_field(roms[rom_index].path).c_str()
+			, csv_field(scripts.empty() ? "-" : scripts[script_index].path).c_str()
+			, seeds[seed_index]
+			, csv_field(res.reason).c_str()
+			, csv_field(res.error).c_str()
+			, static_cast<unsigned long long>(res.insts)
+			, static_cast<unsigned long long>(res.frames)
+			, static_cast<unsigned long long>(res.fb_hash)
+			, res.ms);
+	}
+
+	if (out != stdout)
+	{
+		std::fclose(out);
+	}
+
+	return 0;
+}
@@ -0,0 +1,360 @@
+#include "capture.h"
+
+#include <algorithm>
+#include <cstring>
+
+// WaitOnAddress
+#pragma comment(lib, "Synchronization.lib")
+
+// CRC-32 of PNG chunks
+static const std::array<u32, 256> s_crc_table = []()
+{
+	std::array<u32, 256> table{};
+
+	for (u32 i = 0; i < 256; i++)
+	{
+		u32 crc = i;
+
+		for (u32 bit = 0; bit < 8; bit++)
+		{
+			crc = crc & 1 ? 0xedb88320 ^ (crc >> 1) : crc >> 1;
+		}
+
+		table[i] = crc;
+	}
+
+	return table;
+}();
+
+static void put_be32(std::vector<u8>& out, u32 value)
+{
+	out.push_back(static_cast<u8>(value >> 24));
+	out.push_back(static_cast<u8>(value >> 16));
+	out.push_back(static_cast<u8>(value >> 8));
+	out.push_back(static_cast<u8>(value));
+}
+
+// LSB first bit stream of a deflate block
+struct bit_writer
+{
+	std::vector<u8>& out;
+	u32 acc = 0;
+	u32 count = 0;
+
+	void put(u32 bits, u32 n)
+	{
+		acc |= bits << count;
+		count += n;
+
+		for (; count >= 8; count -= 8, acc >>= 8)
+		{
+			out.push_back(static_cast<u8>(acc));
+		}
+	}
+
+	// Huffman codes are sent MSB first
+	void put_code(u32 code, u32 n)
+	{
+		u32 reversed = 0;
+
+		for (u32 i = 0; i < n; i++)
+		{
+			reversed |= ((code >> i) & 1) << (n - 1 - i);
+		}
+
+		put(reversed, n);
+	}
+
+	// Literal/length symbol of the fixed Huffman code
+	void put_symbol(u32 symbol)
+	{
+		if (symbol < 144) put_code(0x30 + symbol, 8);
+		else if (symbol < 256) put_code(0x190 + symbol - 144, 9);
+		else if (symbol < 280) put_code(symbol - 256, 7);
+		else put_code(0xc0 + symbol - 280, 8);
+	}
+
+	void flush()
+	{
+		if (count)
+		{
+			out.push_back(static_cast<u8>(acc));
+		}
+
+		acc = count = 0;
+	}
+};
+
+// zlib stream with a single fixed Huffman block, repeated bytes are sent as matches at distance 1
+// Filtered scanlines of the display are mostly zero runs, no need for a general match finder
+static void deflate_runs(const u8* data, size_t size, std::vector<u8>& out)
+{
+	static const u16 s_length_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+	static const u8 s_length_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+
+	// CM=8 (deflate), 32K window, no dictionary
+	out.push_back(0x78);
+	out.push_back(0x01);
+
+	bit_writer bits{out};
+
+	// Final block, fixed Huffman codes
+	bits.put(1, 1);
+	bits.put(1, 2);
+
+	for (size_t i = 0; i < size;)
+	{
+		size_t run = 0;
+
+		while (i && run < 258 && i + run < size && data[i + run] == data[i - 1])
+		{
+			run++;
+		}
+
+		if (run < 3)
+		{
+			bits.put_symbol(data[i++]);
+			continue;
+		}
+
+		u32 code = 28;
+
+		while (s_length_base[code] > run)
+		{
+			code--;
+		}
+
+		bits.put_symbol(257 + code);
+		bits.put(static_cast<u32>(run - s_length_base[code]), s_length_extra[code]);
+
+		// Distance 1
+		bits.put_code(0, 5);
+		i += run;
+	}
+
+	bits.put_symbol(256);
+	bits.flush();
+
+	u32 a = 1, b = 0;
+
+	for (size_t i = 0; i < size; i++)
+	{
+		a = (a + data[i]) % 65521;
+		b = (b + a) % 65521;
+	}
+
+	put_be32(out, b << 16 | a);
+}
+
+static void put_chunk(std::vector<u8>& out, const char* type, const u8* data, size_t size)
+{
+	put_be32(out, static_cast<u32>(size));
+	const size_t start = out.size();
+	out.insert(out.end(), type, type + 4);
+	out.insert(out.end(), data, data + size);
+
+	u32 crc = ~0u;
+
+	for (size_t i = start; i < out.size(); i++)
+	{
+		crc = s_crc_table[(crc ^ out[i]) & 0xff] ^ (crc >> 8);
+	}
+
+	put_be32(out, ~crc);
+}
+
+// RGBA8 image to PNG, scanlines repeating the previous one use the Up filter and others the Sub filter
+static void encode_png(const u32* rgba, u32 width, u32 height, std::vector<u8>& out)
+{
+	const size_t stride = size_t{width} * 4;
+	std::vector<u8> raw;
+	raw.reserve((stride + 1) * height);
+
+	for (u32 y = 0; y < height; y++)
+	{
+		const u8* row = reinterpret_cast<const u8*>(rgba + size_t{y} * width);
+
+		if (y && !std::memcmp(row, row - stride, stride))
+		{
+			raw.push_back(2);
+			raw.insert(raw.end(), stride, 0);
+			continue;
+		}
+
+		raw.push_back(1);
+
+		for (size_t i = 0; i < stride; i++)
+		{
+			raw.push_back(static_cast<u8>(row[i] - (i >= 4 ? row[i - 4] : 0)));
+		}
+	}
+
+	std::vector<u8> header;
+	put_be32(header, width);
+	put_be32(header, height);
+
+	// 8 bits per channel, RGBA, deflate, standard filters, not interlaced
+	header.insert(header.end(), { 8, 6, 0, 0, 0 });
+
+	std::vector<u8> idat;
+	deflate_runs(raw.data(), raw.size(), idat);
+
+	out.clear();
+	out.insert(out.end(), { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' });
+	put_chunk(out, "IHDR", header.data(), header.size());
+	put_chunk(out, "IDAT", idat.data(), idat.size());
+	put_chunk(out, "IEND", nullptr, 0);
+}
+
+// BT.601 studio range luma of an RGBA8 color
+static u8 luma(u32 color)
+{
+	const u32 r = color & 0xff, g = (color >> 8) & 0xff, b = (color >> 16) & 0xff;
+	return static_cast<u8>(16 + ((66 * r + 129 * g + 25 * b + 128) >> 8));
+}
+
+video_capture::video_capture(const std::string& path, capture_format format, u32 scale, const palette_t& palette)
+	: m_path(path)
+	, m_format(format)
+	, m_scale(std::clamp<u32>(scale, 1, max_render_scale / 2))
+	, m_palette(palette)
+	, m_width(emu_state::x_size_ex * m_scale)
+	, m_height(emu_state::y_size_ex * m_scale)
+	, m_rgba(size_t{m_width} * m_height)
+{
+	if (m_format == capture_format::y4m)
+	{
+		m_file = std::fopen(path.c_str(), "wb");
+
+		if (!m_file)
+		{
+			m_failed = true;
+			return;
+		}
+
+		// Luma only, 60 fps, square pixels
+		std::fprintf(m_file, "YUV4MPEG2 W%u H%u F60:1 Ip A1:1 Cmono\n", m_width, m_height);
+	}
+
+	m_encoder = std::thread([this]()
+	{
+		encoder_loop();
+	});
+}
+
+video_capture::~video_capture()
+{
+	finish();
+}
+
+void video_capture::capture(const emu_state& state)
+{
+	frame_t* const frame = m_queue.prepare();
+
+	if (!frame)
+	{
+		// The encoder is behind
+		m_dropped++;
+		return;
+	}
+
+	state.copy_framebuffer(frame->lines);
+	frame->extended = state.extended;
+	frame->number = m_captured++;
+	m_queue.push();
+
+	m_signal++;
+	::WakeByAddressSingle(&m_signal);
+}
+
+void video_capture::finish()
+{
+	if (m_encoder.joinable())
+	{
+		m_stop = true;
+		m_signal++;
+		::WakeByAddressSingle(&m_signal);
+		m_encoder.join();
+	}
+
+	if (m_file)
+	{
+		if (std::fclose(m_file))
+		{
+			m_failed = true;
+		}
+
+		m_file = nullptr;
+	}
+}
+
+void video_capture::encoder_loop()
+{
+	while (true)
+	{
+		u32 seen = m_signal.load();
+		const bool stop = m_stop;
+
+		while (const frame_t* frame = m_queue.front())
+		{
+			encode(*frame);
+			m_queue.pop();
+		}
+
+		if (stop)
+		{
+			// Frames queued before stopping were drained above
+			return;
+		}
+
+		// Returns at once if capture or finish signaled since
+		::WaitOnAddress(&m_signal, &seen, sizeof(seen), INFINITE);
+	}
+}
+
+void video_capture::encode(const frame_t& frame)
+{
+	if (m_failed)
+	{
+		return;
+	}
+
+	// Same output size in both modes
+	const u32 width = frame.extended ? emu_state::x_size_ex : emu_state::x_size;
+	const u32 height = frame.extended ? emu_state::y_size_ex : emu_state::y_size;
+	render_rgba(frame.lines, width, height, frame.extended ? m_scale : m_scale * 2, m_palette, m_rgba.data(), m_width);
+
+	if (m_format == capture_format::y4m)
+	{
+		const u8 on = luma(m_palette.on), off = luma(m_palette.off);
+		m_bytes.resize(m_rgba.size());
+
+		for (size_t i = 0; i < m_rgba.size(); i++)
+		{
+			m_bytes[i] = m_rgba[i] == m_palette.on ? on : off;
+		}
+
+		if (std::fputs("FRAME\n", m_file) < 0 || std::fwrite(m_bytes.data(), 1, m_bytes.size(), m_file) != m_bytes.size())
+		{
+			m_failed = true;
+		}
+
+		return;
+	}
+
+	char number[32];
+	std::snprintf(number, sizeof(number), "%06llu.png", static_cast<unsigned long long>(frame.number));
+	encode_png(m_rgba.data(), m_width, m_height, m_bytes);
+
+	std::FILE* const file = std::fopen((m_path + number).c_str(), "wb");
+
+	if (!file || std::fwrite(m_bytes.data(), 1, m_bytes.size(), file) != m_bytes.size())
+	{
+		m_failed = true;
+	}
+
+	if (file && std::fclose(file))
+	{
+		m_failed = true;
+	}
+}
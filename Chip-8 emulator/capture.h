@@ -0,0 +1,87 @@
+#pragma once
+#include "emucore.h"
+#include "softrender.h"
+#include "spscqueue.h"
+
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum class capture_format : u8
+{
+	y4m, // One YUV4MPEG2 stream (monochrome, 60 fps)
+	png, // One PNG file per frame
+};
+
+// Records frames to disk on an encoder thread of its own
+// Frames are copied packed into a pooled slot and handed over a lock-free queue, the emulation thread never waits for the disk
+// When the encoder falls behind the pool is full and frames are dropped (counted)
+class video_capture
+{
+public:
+	// Y4M: 'path' is the file, PNG: 'path' is the prefix of the files, followed by the frame number (e.g. "out/frame-" for "out/frame-000000.png")
+	// The video is 128x64 pixels times 'scale', low resolution frames are scaled twice as much
+	video_capture(const std::string& path, capture_format format, u32 scale, const palette_t& palette = palette_t::mono());
+	~video_capture();
+
+	// False if the output could not be opened or written
+	bool ok() const
+	{
+		return !m_failed;
+	}
+
+	// Queue the current frame (emulation thread, call at the presentation point)
+	void capture(const emu_state& state);
+
+	// Encode the frames queued and stop the encoder, called by the destructor
+	void finish();
+
+	// Statistics (producer side)
+	u64 captured() const
+	{
+		return m_captured;
+	}
+
+	u64 dropped() const
+	{
+		return m_dropped;
+	}
+
+private:
+	struct frame_t
+	{
+		u64 lines[64][2];
+		bool extended;
+		u64 number;
+	};
+
+	void encoder_loop();
+	void encode(const frame_t& frame);
+
+	std::string m_path;
+	capture_format m_format;
+	u32 m_scale;
+	palette_t m_palette;
+	u32 m_width;
+	u32 m_height;
+
+	// Y4M stream
+	std::FILE* m_file = nullptr;
+
+	// Encoder buffers, reused by all frames
+	std::vector<u32> m_rgba;
+	std::vector<u8> m_bytes;
+
+	// Half a second of frames at 60hz
+	spsc_queue<frame_t, 32> m_queue;
+
+	// Bumped on every push and on finish, the encoder waits on it to change
+	std::atomic<u32> m_signal{0};
+	std::atomic<bool> m_stop{false};
+	std::atomic<bool> m_failed{false};
+	std::thread m_encoder;
+
+	u64 m_captured = 0;
+	u64 m_dropped = 0;
+};
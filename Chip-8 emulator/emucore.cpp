@@ -1,11 +1,15 @@
-#include "render.h"
 #include "input.h"
 #include "emucore.h"
-#include "hwtimers.h"
 #include "ASMJIT/AsmInterpreter.h"
 
 emu_state g_state;
 
+// Layout: registers touched by every instruction share a cache line
+static_assert(offsetof(emu_state, gpr) % 64 == 0 && offsetof(emu_state, emu_started) - offsetof(emu_state, gpr) < 64, "emu_state: hot registers must fit in one cache line");
+static_assert(offsetof(emu_state, stack) % 64 == 0, "emu_state: stack must start a cache line");
+static_assert(sizeof(emu_state) <= 32 * 1024, "emu_state: lookup tables belong outside of the instance");
+static_assert(guest_image::size >= emu_state::index_mask + 1 + 32, "guest_image: XDRW at the highest index must stay inside the view");
+
 static const u8 fontset[80] =
 { 
 	0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
@@ -26,38 +30,463 @@ static const u8 fontset[80] =
 	0xF0, 0x80, 0xF0, 0x80, 0x80  // F
 };
 
-void emu_state::reset()
+const char* exit_reason_name(exit_reason reason)
+{
+	switch (reason)
+	{
+	case exit_reason::none: return "none";
+	case exit_reason::unknown_instruction: return "unknown instruction";
+	case exit_reason::stack_overflow: return "stack overflow";
+	case exit_reason::stack_underflow: return "stack underflow";
+	case exit_reason::halted: return "halted";
+	case exit_reason::key_wait: return "key wait";
+	}
+
+	return "?";
+}
+
+guest_image::~guest_image()
+{
+	if (m_data)
+	{
+		::UnmapViewOfFile(m_data);
+	}
+
+	::CloseHandle(m_section);
+}
+
+std::shared_ptr<guest_image> guest_image::create(const u8* rom, size_t rom_size)
+{
+	// Sanity checks for file size
+	if (rom_size > (ram_size - 512))
+	{
+		return nullptr;
+	}
+
+	auto img = std::make_shared<guest_image>();
+
+	// Pagefile backed section, zero initialized
+	img->m_section = ::CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, static_cast<DWORD>(size), nullptr);
+
+	if (!img->m_section)
+	{
+		return nullptr;
+	}
+
+	const auto view = static_cast<u8*>(::MapViewOfFile(img->m_section, FILE_MAP_WRITE, 0, 0, size));
+
+	if (!view)
+	{
+		return nullptr;
+	}
+
+	std::memcpy(view, fontset, sizeof(fontset));
+
+	if (rom_size)
+	{
+		// Executable load start address is 0x200
+		std::memcpy(view + 0x200, rom, rom_size);
+	}
+
+	std::memset(view + ram_size, 0xFF, size - ram_size); // Spill region, starts with the instruction flow guard
+	::UnmapViewOfFile(view);
+
+	img->m_data = static_cast<const u8*>(::MapViewOfFile(img->m_section, FILE_MAP_READ, 0, 0, size));
+	return img->m_data ? img : nullptr;
+}
+
+const std::shared_ptr<guest_image>& guest_image::blank()
+{
+	static const auto img = create(nullptr, 0);
+	return img;
+}
+
+u8* guest_image::map() const
+{
+	// Writes go to private pages of the view, never to the section
+	return static_cast<u8*>(::MapViewOfFile(m_section, FILE_MAP_COPY, 0, 0, size));
+}
+
+void guest_image::unmap(u8* view)
+{
+	if (view)
+	{
+		::UnmapViewOfFile(view);
+	}
+}
+
+emu_state::~emu_state()
 {
-	std::memset(memBase, 0, sizeof(memBase));
-	std::memcpy(memBase, fontset, sizeof(fontset));
+	guest_image::unmap(memBase);
+}
+
+void emu_state::reset(std::shared_ptr<guest_image> img)
+{
+	// Map the requested image directly, attaching blank first would map guest memory twice
+	attach_image(img ? std::move(img) : guest_image::blank());
 	std::memset(gfxMemory, 0, sizeof(gfxMemory));
+	std::memset(row_epoch, 0, sizeof(row_epoch));
+	gfx_epoch = 0;
+	row_base = 0;
 	std::memset(gpr, 0, sizeof(gpr));
 	std::memset(stack, 0, sizeof(stack));
 	std::memset(reg_save, 0, sizeof(reg_save));
-	emu_state::load_exec(); // Load executable and settings
-	this->ref<u16>(4096) = 0xFFFF; // Instruction flow guard
 	sp = 0;
 	pc = 0x200;
 	index = 0;
-	timers.data = {};
-	asm_insts::build_all(ops);
-	hwtimers = new std::thread(timerJob);
+	timers = {};
+	extended = false;
+	compatibilty = 0;
+	exit_code = exit_reason::none;
+	last_error = "";
+	inst_count = 0;
+	frame_count = 0;
+	cycles = 0;
+	clock_origin = std::chrono::steady_clock::now();
+	key_state = 0;
+
+	{
+		std::lock_guard<std::mutex> lock(key_mutex);
+		key_events.clear();
+		has_key_events = false;
+	}
+	seed_random(zext<u32>(__rdtsc()));
+	select_ops();
+}
+
+void emu_state::select_ops()
+{
+	// 00FA turns on the index increment of FX55/FX65 (see asm_insts::Compat)
+	quirk_profile profile = quirks;
+	profile.index_increment |= compatibilty != 0;
+	ops = asm_insts::build_all({ is_super, headless, vip_timing, profile });
+}
+
+bool emu_state::load_rom(const u8* data, size_t size)
+{
+	auto img = size ? guest_image::create(data, size) : nullptr;
+
+	if (!img)
+	{
+		return false;
+	}
+
+	attach_image(std::move(img));
+	return true;
+}
+
+void emu_state::attach_image(std::shared_ptr<guest_image> img)
+{
+	guest_image::unmap(memBase);
+	memBase = assert(img->map());
+	image = std::move(img);
+}
+
+exit_reason emu_state::run(u32 budget)
+{
+	inst_budget = budget;
+	exit_code = exit_reason::none;
+	asm_insts::entry(this);
+
+	// The budget is decremented only by completed instructions (wraps around when the last one overruns it)
+	(vip_timing ? cycles : inst_count) += budget - inst_budget;
+	return exit_code;
+}
+
+exit_reason emu_state::run_frame(u32 insts)
+{
+	exit_reason reason;
+
+	// Input is sampled at frame boundaries
+	apply_key_events();
+
+	if (vip_timing)
+	{
+		// Cycles past the vblank are taken from the next frame
+		const u64 vblank = (frame_count + 1) * vip_cycles_per_frame;
+		reason = run(cycles < vblank ? static_cast<u32>(vblank - cycles) : 1);
+
+		// Frames ended early (display wait, key wait) idle until the vblank
+		cycles = std::max(cycles, vblank);
+	}
+	else
+	{
+		reason = run(insts);
+	}
+
+	// Waiting for a key only ends the frame early, time still passes
+	frame_count++;
+	return reason;
+}
+
+void emu_state::skip_frames(u64 count)
+{
+	frame_count += count;
+
+	if (vip_timing)
+	{
+		cycles += count * vip_cycles_per_frame;
+	}
+}
+
+// Set or clear the key and wake a parked FX0A
+static void set_key(std::atomic<u16>& keys, u8 key, bool down)
+{
+	down ? keys.fetch_or(static_cast<u16>(1u << key)) : keys.fetch_and(static_cast<u16>(~(1u << key)));
+	::WakeByAddressAll(&keys);
+}
+
+void emu_state::post_key(u8 key, bool down, u64 tick)
+{
+	if (!headless)
+	{
+		// Window input, FX0A may be parked on it
+		return set_key(key_state, key & 0xf, down);
+	}
+
+	std::lock_guard<std::mutex> lock(key_mutex);
+	key_events.push_back({ tick, static_cast<u8>(key & 0xf), down });
+	has_key_events = true;
+}
+
+void emu_state::apply_key_events()
+{
+	if (!has_key_events)
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(key_mutex);
+
+	// Due events in posting order, later ones are kept
+	size_t kept = 0;
+
+	for (const auto& e : key_events)
+	{
+		if (e.tick <= frame_count)
+		{
+			set_key(key_state, e.key, e.down);
+		}
+		else
+		{
+			key_events[kept++] = e;
+		}
+	}
+
+	key_events.resize(kept);
+	has_key_events = kept != 0;
+}
+
+u64 emu_state::current_tick() const
+{
+	if (frame_ticks())
+	{
+		return frame_count;
+	}
+
+	return (std::chrono::steady_clock::now() - clock_origin) * 60 / std::chrono::seconds(1);
+}
+
+static u8 timer_value(u8 value, u64 tick, u64 now)
+{
+	const u64 elapsed = now - tick;
+	return elapsed < value ? static_cast<u8>(value - elapsed) : 0;
+}
+
+u8 emu_state::delay_timer() const
+{
+	return timer_value(timers.delay, timers.delay_tick, current_tick());
+}
+
+u8 emu_state::sound_timer() const
+{
+	return timer_value(timers.sound, timers.sound_tick, current_tick());
+}
 
-	// Generate a lookup table for all possible pixels values for DRW 
-	for (u32 i = 0; i < UINT8_MAX + 1; i++)
+void emu_state::set_delay(u8 value)
+{
+	timers.delay = value;
+	timers.delay_tick = current_tick();
+}
+
+void emu_state::set_sound(u8 value)
+{
+	const bool was_on = sound_timer() != 0;
+	timers.sound = value;
+	timers.sound_tick = current_tick();
+
+	if (!headless && value && !was_on)
+	{
+		// Beep at the sound-on edge
+		std::cout << "\a";
+	}
+}
+
+void emu_state::present(u64 rows)
+{
+	dirty_rows |= rows;
+
+	if (frame_sink)
 	{
-		u64 to_write = {};
+		frame_sink(*this);
+	}
+}
+
+u64 emu_state::draw_row_mask() const
+{
+	u64 mask = 0;
 
-		for (u32 bit = 0; bit < 8; bit++)
+	for (u32 i = 0, y = draw_y; i < draw_rows; i++, y++)
+	{
+		if (y >= height())
 		{
-			if (i & (1u << bit))
+			if (!quirks.draw_wrap)
 			{
-				to_write |= UINT64_C(0xFF) << ((7 - bit) * 8);
+				break;
 			}
+
+			y = 0;
 		}
 
-		DRWtable[i] = to_write;
+		mask |= u64{1} << y;
+	}
+
+	return mask;
+}
+
+u64 emu_state::framebuffer_hash() const
+{
+	// FNV-1a over the words of visible lines
+	u64 hash = UINT64_C(0xcbf29ce484222325);
+
+	for (u32 y = 0; y < height(); y++)
+	{
+		for (u32 w = 0; w < width() / 64; w++)
+		{
+			const u32 line = row_index(y);
+			const u64 bits = row_valid(line) ? gfxMemory[line][w] : 0;
+
+			for (u32 i = 0; i < 64; i += 8)
+			{
+				hash ^= (bits >> i) & 0xff;
+				hash *= UINT64_C(0x100000001b3);
+			}
+		}
 	}
+
+	return hash;
+}
+
+// Visit the rows of the last drawn sprite: fn(line, word, next word, bits of the word, bits shifted out of it)
+// Returns the count of rows clipped at the bottom edge
+template <typename F>
+static u32 visit_sprite_rows(const emu_state& s, F&& fn)
+{
+	// Must match DRW in generated code
+	const u32 words = s.width() / 64;
+	const u32 lines = s.height();
+	const u32 shift = s.draw_x % 64;
+	const u32 w = s.draw_x / 64;
+	const u32 next = (w + 1) % words;
+	const u8* const sprite = s.memBase + s.draw_addr;
+
+	for (u32 row = 0, y = s.draw_y; row < s.draw_rows; row++, y++)
+	{
+		if (y == lines)
+		{
+			if (!s.quirks.draw_wrap)
+			{
+				return s.draw_rows - row;
+			}
+
+			y = 0;
+		}
+
+		const u64 bits = s.draw_wide ? (u64{sprite[row * 2]} << 56 | u64{sprite[row * 2 + 1]} << 48) : u64{sprite[row]} << 56;
+
+		// Bits within the first word and bits shifted out of it (into the next word or past the right edge)
+		const u64 first = bits >> shift;
+		const u64 second = shift && (s.quirks.draw_wrap || w + 1 < words) ? bits << (64 - shift) : 0;
+
+		fn(s.row_index(y), w, next, first, second);
+	}
+
+	return 0;
+}
+
+void emu_state::draw_sprite(u32 x, u32 y, u32 addr, u32 rows, bool wide)
+{
+	draw_addr = addr;
+	draw_x = static_cast<u8>(x & (width() - 1));
+	draw_y = static_cast<u8>(y & (height() - 1));
+	draw_rows = static_cast<u8>(rows);
+	draw_wide = wide;
+
+	visit_sprite_rows(*this, [&](u32 line, u32 w, u32 next, u64 first, u64 second)
+	{
+		if (!row_valid(line))
+		{
+			// Cleared since last touched
+			gfxMemory[line][0] = 0;
+			gfxMemory[line][1] = 0;
+			row_epoch[line] = gfx_epoch;
+		}
+
+		gfxMemory[line][w] ^= first;
+		gfxMemory[line][next] ^= second;
+	});
+}
+
+u8 emu_state::draw_result() const
+{
+	u32 collided = 0;
+
+	// Sprite pixels which are clear now were set before the XOR
+	const u32 clipped = visit_sprite_rows(*this, [&](u32 line, u32 w, u32 next, u64 first, u64 second)
+	{
+		collided += ((~gfxMemory[line][w] & first) | (~gfxMemory[line][next] & second)) != 0;
+	});
+
+	// SCHIP 1.1: clipped rows count as collided in extended mode
+	return extended ? static_cast<u8>(collided + clipped) : collided != 0;
+}
+
+void emu_state::copy_framebuffer(u64 (*out)[2]) const
+{
+	for (u32 y = 0; y < y_size_ex; y++)
+	{
+		const u32 line = row_index(y);
+		out[y][0] = row_valid(line) ? gfxMemory[line][0] : 0;
+		out[y][1] = row_valid(line) ? gfxMemory[line][1] : 0;
+	}
+}
+
+void emu_state::clear_screen()
+{
+	// Must match CLS in generated code
+	if (++gfx_epoch == 0)
+	{
+		// Epoch wrapped around, old tags may look current again
+		std::memset(gfxMemory, 0, sizeof(gfxMemory));
+		std::memset(row_epoch, 0, sizeof(row_epoch));
+	}
+}
+
+void emu_state::seed_random(u32 seed)
+{
+	// Zero is a fixed point of xorshift
+	rng_state = seed ? seed : 1;
+}
+
+u8 emu_state::next_random()
+{
+	// xorshift32, must match RND in generated code
+	u32 x = rng_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	rng_state = x;
+	return static_cast<u8>(x);
 }
 
 u8& emu_state::getVF()
@@ -99,8 +528,8 @@ void emu_state::OpcodeFallback()
 		else if (opcode == 0x00E0)
 		{
 			// CLS: Display clear
-			std::memset(gfxMemory, 0, sizeof(gfxMemory));
-			KickChip8Framebuffer(gfxMemory);
+			clear_screen();
+			present();
 			return Procceed();
 		}
 		else
@@ -352,87 +781,16 @@ void emu_state::OpcodeFallback()
 	{
 		// RND: Set random number with bit mask
 		const u8 reg = getField<2>(opcode);
-		gpr[reg] = std::rand() & (opcode & 0xFF);
+		gpr[reg] = next_random() & (opcode & 0xFF);
 		return Procceed();
 	}
 	case 0xD:
 	{
 		// DRW: Draw call sprite
-		//NOTE: framebuffer layout: swizzled buffer
-		// offset 15 bits long : [1bit cleared][5 bits y][1bit cleared][6 bits x]
-
-		//const u8 reg = getField<2>(opcode);
-		//const u8 reg2 = getField<1>(opcode);
-		const u8 size = getField<0>(opcode);
-
-		// Get the start of sprite location in vram
-		size_t offset = (gpr[getField<2>(opcode)] & 0x3f) + ((gpr[getField<1>(opcode)] & 0x1f) * y_stride);
-
-#ifdef  DEBUG_INSTS
-		if ((gpr[getField<2>(opcode)] & ~0x3f) || (gpr[getField<1>(opcode)] & ~0x1f))
-		{
-			hwBpx();
-		}
-#endif
-
-		// Get the start of the sprite in ram
-		auto& src = this->ref<u8[]>(index);
-
-		// Packed row of pixels
-		u8 pvalue;
-
-		// Assume no pixels unset at start
-		getVF() = 0;
-
 		//NOTE: This draws in XOR mode! - meaning the pixel color is flipped anytime any bit is 1
-
-		for (u32 row = 0; row < size; row++, offset += y_stride)
-		{
-			pvalue = src[row];
-
-			if (!pvalue)
-			{
-				continue;
-			}
-
-			size_t used_offset = offset;
-
-			// Unpack bits into pixels
-			for (u32 i = 0; i < 8; i++, used_offset++)
-			{
-				// Do nothing if zero
-				if (((pvalue << i) & 0x80) == 0)
-				{
-					continue;
-				}
-
-				if (DRW_wrapping)
-				{
-					// Wrap around x and y axises
-					used_offset &= xy_mask;
-				}
-				else
-				{
-					// Skip pixel if not within bounderies
-					if ((used_offset & (~xy_mask)) != 0)
-						continue;
-				}
-
-				// Obtain pointer to the pixel dst
-				auto& pix = gfxMemory[used_offset];
-
-				if (pix != 0)
-				{
-					// Pixel unset
-					getVF() = 1;
-				}
-
-				// Update pixel
-				pix ^= 0xff;
-			}
-		}
-
-		KickChip8Framebuffer(gfxMemory);
+		draw_sprite(gpr[getField<2>(opcode)], gpr[getField<1>(opcode)], index, getField<0>(opcode), false);
+		getVF() = draw_result();
+		present(draw_row_mask());
 		return Procceed();
 	}
 	case 0xE:
@@ -447,7 +805,7 @@ void emu_state::OpcodeFallback()
 			// SKP: Skip instruction if specified key is pressed
 			const u8 reg = getField<2>(opcode);
 
-			const bool pressed = TestKeyState(keyIDs[gpr[reg] & 0xf]);
+			const bool pressed = ((key_state >> (gpr[reg] & 0xf)) & 1) != 0;
 
 			if (pressed)
 			{
@@ -462,7 +820,7 @@ void emu_state::OpcodeFallback()
 			// SKNP: Skip instruction if specified key is not pressed
 			const u8 reg = getField<2>(opcode);
 
-			const bool pressed = TestKeyState(keyIDs[gpr[reg] & 0xf]);
+			const bool pressed = ((key_state >> (gpr[reg] & 0xf)) & 1) != 0;
 
 			if (!pressed)
 			{
@@ -486,13 +844,13 @@ void emu_state::OpcodeFallback()
 		{
 			// Get delay timer
 			const u8 reg = getField<2>(opcode);
-			gpr[reg] = timers.delay;
+			gpr[reg] = delay_timer();
 			return Procceed();
 		}
 		case 0x0A:
 		{
 			// Get next key press (blocking)
-			u8 keyid = input::WaitForPress();
+			u8 keyid = input::WaitForPress(key_state);
 
 			const u8 reg = getField<2>(opcode);
 			gpr[reg] = keyid;
@@ -501,17 +859,13 @@ void emu_state::OpcodeFallback()
 		case 0x15:
 		{
 			// Set dealy timer
-			const u8 value = gpr[getField<2>(opcode)];
-			timers.delay = value;
-
+			set_delay(gpr[getField<2>(opcode)]);
 			return Procceed();
 		}
 		case 0x18:
 		{
 			// Set sound timer
-			const u8 value = gpr[getField<2>(opcode)];
-			timers.sound = value;
-
+			set_sound(gpr[getField<2>(opcode)]);
 			return Procceed();
 		}
 		case 0x1E:
@@ -519,7 +873,7 @@ void emu_state::OpcodeFallback()
 			// Add register value to mem pointer
 			// note: value is not clamped to 12-bits on realhw
 			const u8 reg = getField<2>(opcode);
-			index += (u32)gpr[reg];
+			index = (index + gpr[reg]) & index_mask;
 			return Procceed();
 		}
 		case 0x29:
@@ -555,7 +909,7 @@ void emu_state::OpcodeFallback()
 			// Reg array store 
 			const u8 max_reg = getField<2>(opcode) + 1;
 			std::memcpy(this->ptr<u8>(index), &gpr[0], max_reg);
-			index += max_reg;
+			index = (index + max_reg) & index_mask;
 			return Procceed();
 		}
 		case 0x65:
@@ -563,7 +917,7 @@ void emu_state::OpcodeFallback()
 			// Reg array load
 			const u8 max_reg = getField<2>(opcode) + 1;
 			std::memcpy(&gpr[0], this->ptr<u8>(index), max_reg);
-			index += max_reg;
+			index = (index + max_reg) & index_mask;
 			return Procceed();
 		}
 		default: break;
@@ -1,67 +1,243 @@
 #pragma once
 
 #include "utils.h"
+#include "quirks.h"
+#include <memory>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+// Reason for leaving the generated code
+enum class exit_reason : u32
+{
+	none = 0, // Instruction budget consumed (end of time slice)
+	unknown_instruction,
+	stack_overflow,
+	stack_underflow,
+	halted, // Jump to itself, nothing can change anymore
+	key_wait, // FX0A without a pressed key (headless only)
+};
+
+const char* exit_reason_name(exit_reason reason);
+
+// Key event stamped with the 60hz tick it takes effect at
+struct key_event
+{
+	u64 tick;
+	u8 key;
+	bool down;
+};
+
+// Guest memory image (fontset and rom) shared by all instances running the same rom
+// Every instance maps a copy-on-write view of it, pages are only duplicated when written (FX33, FX55)
+class guest_image
+{
+	HANDLE m_section = nullptr;
+	const u8* m_data = nullptr;
+
+public:
+	// The RAM (4k) followed by the spill region
+	// 'index' is 16 bits wide and accesses reach up to 32 bytes past it, all of which lands inside the view
+	// The spill region is filled with 0xFF (executing it hits UNK), writes to it stay private to the instance
+	// The view ends in the middle of an allocation granule, accesses past it fault instead of corrupting host memory
+	static constexpr size_t ram_size = 4096;
+	static constexpr size_t size = 0x10000 + 0x1000;
+
+	~guest_image();
+
+	// Create an image with the rom placed at 0x200, returns nullptr if the rom doesn't fit
+	static std::shared_ptr<guest_image> create(const u8* rom, size_t rom_size);
+
+	// Image without a rom (fontset only)
+	static const std::shared_ptr<guest_image>& blank();
+
+	// Read-only view of the pristine image
+	const u8* data() const
+	{
+		return m_data;
+	}
+
+	// Map a private view of the image
+	u8* map() const;
+	static void unmap(u8* view);
+};
 
 struct emu_state
 {
-	// The RAM (4k + instruction flow guard)
-	alignas(16) u8 memBase[4096 + 2];
+	// Hot section: registers and per-instruction state (one cache line)
 	// Registers
-	u8 gpr[16];
-	// Stack
-	u32 stack[16];
-	// Stack pointer
-	u32 sp;
+	alignas(64) u8 gpr[16];
 	// Current instruction address
 	u32 pc;
 	// Memory pointer
 	u32 index;
-	// Container for delay timer and sound timer
-	union { volatile u16 data; struct { volatile u8 sound, delay; }; } timers;
-	// Set when it's time to close the emulator
-	volatile bool terminate = false;
-	// Timers thread's thread handle
-	std::thread* hwtimers;
-	// DRW pixel decoding lookup table
-	u64 DRWtable[UINT8_MAX + 1]; 
-	// compatibilty flag (mask) for schip 8 (don't confuse with is_super)
+	// Stack pointer
+	u32 sp;
+	// Instructions left to execute until the current time slice ends
+	u32 inst_budget = 0;
+	// The RAM (4k + spill region), private view of 'image'
+	u8* memBase = nullptr;
+	// Asmjit/Interpreter: function table (shared by all instances with the same settings)
+	const std::uintptr_t* ops = nullptr;
+	// RND generator state (xorshift32)
+	u32 rng_state = 1;
+	// compatibilty flag for schip 8, set by 00FA (don't confuse with is_super)
 	u32 compatibilty = 0;
-	// Place to save and restore registers in 'flags'
-	u8 reg_save[16];
+	// Reason of the last exit from generated code
+	exit_reason exit_code = exit_reason::none;
+	// Held keys (bit n = key n), written by input events (see post_key), SKP/SKNP test it with a single bt
+	std::atomic<u16> key_state{0};
 	// Video mode
 	bool extended = false;
-	// Asmjit/Interpreter: function table
-	std::uintptr_t ops[UINT16_MAX + 1];
+	// is in emulation?
+	bool emu_started = false;
+
+	// Stack
+	alignas(64) u32 stack[16];
+
+	// Delay and sound timers: value and the 60hz tick it was set at, the current value is computed on demand
+	alignas(64) struct { u64 delay_tick, sound_tick; u8 delay, sound; } timers;
+
+	// Cold section: settings, debug data and statistics
+	// Place to save and restore registers in 'flags'
+	alignas(64) u8 reg_save[16];
 	// Settings section: sleep between instructions in ms
 	u64 sleep_period = 16;
 	// Is schip 8 boolean
 	bool is_super = false;
-	// DRW wrapping override
-	bool DRW_wrapping = false;
+	// Compatibility behaviors (set before reset)
+	quirk_profile quirks = quirk_profile::chip8();
+	// Settings section: run without window, input and realtime pacing
+	bool headless = false;
+	// Settings section: charge instructions their COSMAC VIP cost, frames are 1/60s of virtual VIP time
+	bool vip_timing = false;
 	// Debug data: last error string
 	const char* last_error = "";
-	// is in emulation?
-	bool emu_started = false;
+	// Statistics: executed instructions and frames
+	u64 inst_count = 0;
+	u64 frame_count = 0;
+	// Virtual clock: VIP machine cycles elapsed (vip_timing only)
+	u64 cycles = 0;
+	// Wall clock time of tick 0 (timers of realtime instances)
+	std::chrono::steady_clock::time_point clock_origin{};
+	// Frame presentation callback (none if headless)
+	void (*frame_sink)(emu_state&) = nullptr;
+	// Visible lines changed since the frame sink last took them (bit y = line y)
+	u64 dirty_rows = 0;
+	// Memory image the RAM is mapped from
+	std::shared_ptr<guest_image> image;
+	// Headless input: events waiting for their frame boundary (guarded by the mutex, the flag is set while not empty)
+	std::mutex key_mutex;
+	std::vector<key_event> key_events;
+	std::atomic<bool> has_key_events{false};
+	// Last DRW (x and y masked), its VF result is computed when something needs it
+	u32 draw_addr = 0;
+	u8 draw_x = 0;
+	u8 draw_y = 0;
+	u8 draw_rows = 0;
+	bool draw_wide = false;
+	~emu_state();
 	// Opcodes simple fallbacks
 	void OpcodeFallback();
-	// Reset registers
-	void reset();
-	// Load rom
+	// Reset registers and compile the instruction table for current settings, mapping 'img' (blank if null) as guest memory
+	void reset(std::shared_ptr<guest_image> img = nullptr);
+	// Select the instruction table for current settings and compatibility flag
+	void select_ops();
+	// Load rom interactively (front-end only)
 	void load_exec();
+	// Create a memory image with the rom at the executable load address and map it
+	bool load_rom(const u8* data, size_t size);
+	// Map a fresh view of a (possibly shared) memory image, previous memory content is discarded
+	void attach_image(std::shared_ptr<guest_image> img);
+	// Run up to 'budget' instructions (machine cycles with vip_timing, the last instruction may overrun it)
+	exit_reason run(u32 budget);
+	// Run a single 60hz frame (instructions and timers tick), with vip_timing 'insts' is ignored and the frame ends at the next virtual vblank
+	exit_reason run_frame(u32 insts);
+	// Let 'count' frames pass without running instructions (timers tick), for instances resumed after idling
+	void skip_frames(u64 count);
+	// Current 60hz tick: the frame count if frames are emulated (headless or vip_timing), otherwise wall clock time
+	u64 current_tick() const;
+	// Timers count down one per tick from the value set, the sound is on while the sound timer is non-zero
+	u8 delay_timer() const;
+	u8 sound_timer() const;
+	void set_delay(u8 value);
+	void set_sound(u8 value);
+	// Timers tick with frames instead of wall clock time
+	bool frame_ticks() const
+	{
+		return headless || vip_timing;
+	}
+	// Hand the current framebuffer to the frame sink, 'rows' are the visible lines changed since the last call
+	void present(u64 rows = ~u64{0});
+	// Visible lines touched by the last draw
+	u64 draw_row_mask() const;
+	// Hash of the visible framebuffer
+	u64 framebuffer_hash() const;
+	// Draw a sprite at 'addr' in XOR mode (8 or 16 pixels wide), VF is left to draw_result
+	void draw_sprite(u32 x, u32 y, u32 addr, u32 rows, bool wide);
+	// VF result of the last draw (valid until the framebuffer, the sprite or the mode changes):
+	// 1 if any pixel was unset, in extended mode the number of rows with a collision or clipped (SCHIP 1.1)
+	u8 draw_result() const;
+	// Copy all 64 lines in screen order, lines cleared since last drawn as zero (packed layout of gfxMemory)
+	void copy_framebuffer(u64 (*out)[2]) const;
+	// Clear the screen (bumps the framebuffer epoch)
+	void clear_screen();
+	// Framebuffer line holding visible line 'y'
+	u32 row_index(u32 y) const
+	{
+		return (y + row_base) % y_size_ex;
+	}
+
+	// Framebuffer line content is current (lines tagged with an older epoch read as zero)
+	bool row_valid(u32 line) const
+	{
+		return row_epoch[line] == gfx_epoch;
+	}
+	// Visible framebuffer size in pixels
+	u32 width() const
+	{
+		return extended ? x_size_ex : x_size;
+	}
+
+	u32 height() const
+	{
+		return extended ? y_size_ex : y_size;
+	}
+	// Press or release a key (thread safe)
+	// Headless instances apply it at the first frame boundary at or past 'tick' (deterministic), others immediately
+	void post_key(u8 key, bool down, u64 tick);
+	// Apply due key events (frame boundary)
+	void apply_key_events();
+	// Seed RND
+	void seed_random(u32 seed);
+	// Next RND value
+	u8 next_random();
 	// VF reference wrapper
 	u8& getVF();
 
-	// Framebuffer swizzling constants
-	static constexpr size_t y_stride = 256;
+	// Framebuffer size constants
 	static constexpr size_t y_size_ex = 64;
 	static constexpr size_t x_size_ex = 128;
 	static constexpr size_t y_size = 32;
 	static constexpr size_t x_size = 64;
-	static constexpr size_t xy_mask = (0x1f * y_stride) | (0x3f);
-	static constexpr size_t xy_mask_ex = (0x3f * y_stride) | (0x7f);
 
-	// Video memory (128*64 pixels max, see DRW for details)
-	alignas(32) u8 gfxMemory[y_stride * y_size_ex];
+	// VIP machine cycles per 60hz frame (1.76MHz, 8 clocks per cycle) left to the interpreter
+	// The display DMA and the timers interrupt take about 400 of the 3668
+	static constexpr u32 vip_cycles_per_frame = 3268;
+
+	// Memory pointer wraps at 16 bits (see guest_image)
+	static constexpr u32 index_mask = 0xFFFF;
+
+	// Framebuffer generation: CLS only bumps the epoch, lines are zeroed lazily by the next DRW touching them
+	alignas(64) u8 row_epoch[y_size_ex];
+	u8 gfx_epoch = 0;
+	// Framebuffer line shown at the top of the screen (modulo 64, scrolling down rotates it)
+	u8 row_base = 0;
+
+	// Video memory (128*64 pixels max): 1 bit per pixel, the MSB is the leftmost pixel
+	// Each line is two words (x 0-63 and x 64-127), non-extended mode only uses the first
+	// Lines are circular, visible line y is stored at (y + row_base) % 64 in both modes
+	alignas(64) u64 gfxMemory[y_size_ex][2];
 
 	// Emulated CPU memory control
 	template<typename T>
@@ -0,0 +1,426 @@
+#include "host.h"
+
+#include <algorithm>
+
+// Interactive sessions run one frame per 60hz tick
+static constexpr std::chrono::nanoseconds s_frame_period{1000000000 / 60};
+
+static size_t get_worker_count(const session_host::settings_t& settings)
+{
+	return settings.workers ? settings.workers : std::max<size_t>(std::thread::hardware_concurrency(), 1);
+}
+
+// Order sleeping sessions as a min-heap by due time
+static bool later_frame(const std::shared_ptr<session>& a, const std::shared_ptr<session>& b)
+{
+	return a->next_frame > b->next_frame;
+}
+
+// Nothing to do, delivering the APC is what ends the worker's wait
+static void CALLBACK on_frame_timer(LPVOID, DWORD, DWORD)
+{
+}
+
+session_host::session_host(const settings_t& settings)
+	: m_ready{ work_stealing_queue<session_ptr>(get_worker_count(settings)), work_stealing_queue<session_ptr>(get_worker_count(settings)) }
+	, m_hibernate_after(settings.hibernate_after)
+{
+	const size_t count = get_worker_count(settings);
+
+	m_port = ::CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, static_cast<DWORD>(count));
+	m_loops = std::make_unique<worker_t[]>(count);
+
+	for (size_t w = 0; w < count; w++)
+	{
+		m_workers.emplace_back([this, w, pin = settings.pin_threads]()
+		{
+			if (pin)
+			{
+				// Keep the worker's queue and its sessions warm in a single core's caches
+				::SetThreadAffinityMask(::GetCurrentThread(), DWORD_PTR{1} << (w % (sizeof(DWORD_PTR) * 8)));
+			}
+
+			// Timer APCs are queued to the thread arming the timer, each worker owns one
+			m_loops[w].timer = ::CreateWaitableTimerExW(nullptr, nullptr, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+
+			if (!m_loops[w].timer)
+			{
+				// High resolution timers need Windows 10 1803
+				m_loops[w].timer = ::CreateWaitableTimerExW(nullptr, nullptr, 0, TIMER_ALL_ACCESS);
+			}
+
+			assert(m_loops[w].timer != nullptr);
+
+			worker_loop(w);
+
+			::CloseHandle(m_loops[w].timer);
+		});
+	}
+}
+
+session_host::~session_host()
+{
+	m_stop = true;
+
+	for (size_t w = 0; w < m_workers.size(); w++)
+	{
+		wake();
+	}
+
+	for (auto& worker : m_workers)
+	{
+		worker.join();
+	}
+
+	// Sessions still runnable when the workers left
+	m_ready[0].clear();
+	m_ready[1].clear();
+
+	::CloseHandle(m_port);
+}
+
+std::shared_ptr<session> session_host::open(std::unique_ptr<emu_state> state, session_priority priority, u32 inst_per_frame)
+{
+	// Generated code of non-headless states blocks on input and sleeps between instructions
+	assert(state && state->headless);
+
+	auto s = std::make_shared<session>();
+	s->state = std::move(state);
+	s->priority = priority;
+	s->inst_per_frame = std::max<u32>(inst_per_frame, 1);
+	s->keys = s->state->key_state.load();
+	s->next_frame = session::clock::now();
+	s->last_input = s->next_frame;
+
+	submit(s);
+	return s;
+}
+
+void session_host::submit(session_ptr s)
+{
+	m_ready[static_cast<size_t>(s->priority)].push(m_next_worker++ % m_workers.size(), std::move(s));
+	wake();
+}
+
+void session_host::wake()
+{
+	// Packets are counted by the port, one posted before a worker starts waiting is not lost
+	::PostQueuedCompletionStatus(m_port, 0, 0, nullptr);
+}
+
+void session_host::close(const std::shared_ptr<session>& s)
+{
+	// Dropped by the next worker picking it up
+	s->closing = true;
+}
+
+void session_host::set_keys(const std::shared_ptr<session>& s, u16 keys)
+{
+	s->last_input = session::clock::now();
+	bool restore = false;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		const u16 changed = s->keys.exchange(keys) ^ keys;
+
+		if (s->hibernated)
+		{
+			// Owned by this thread from now on
+			s->hibernated = false;
+			restore = true;
+		}
+		else
+		{
+			// Press and release events, due at the next frame boundary of the session
+			for (u32 key = 0; key < 16; key++)
+			{
+				if (changed & (1u << key))
+				{
+					s->state->post_key(static_cast<u8>(key), (keys >> key) & 1, 0);
+				}
+			}
+
+			// Running, queued or sleeping sessions see the events by themselves
+			if (!s->parked || !changed)
+			{
+				return;
+			}
+
+			// Owned by this thread until submitted
+			s->parked = false;
+		}
+	}
+
+	if (restore)
+	{
+		const auto start = session::clock::now();
+		s->state = s->snapshot->restore();
+		s->snapshot.reset();
+
+		const u64 elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(session::clock::now() - start).count();
+		s->restore_ns += elapsed;
+
+		// Only this thread owns the session while it wakes up
+		if (elapsed > s->max_restore_ns)
+		{
+			s->max_restore_ns = elapsed;
+		}
+
+		if (!s->state)
+		{
+			s->finished = true;
+			return;
+		}
+
+		// Not running yet, no need to go through events
+		s->state->key_state = keys;
+	}
+
+	resume(*s);
+	submit(s);
+}
+
+bool session_host::park(size_t worker, const session_ptr& s)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	// Input arrived during the slice, it is applied at the next frame boundary
+	if (s->state->has_key_events)
+	{
+		return false;
+	}
+
+	s->parked = true;
+	s->parked_at = session::clock::now();
+	s->park_count++;
+
+	if (m_hibernate_after.count())
+	{
+		m_loops[worker].idle.push_back({ s, s->park_count, s->last_input.load() + m_hibernate_after });
+	}
+
+	return true;
+}
+
+void session_host::resume(session& s)
+{
+	const auto now = session::clock::now();
+
+	if (s.priority == session_priority::interactive)
+	{
+		// Timers kept ticking while parked, the frames missed are skipped instead of run
+		s.state->skip_frames(static_cast<u64>((now - s.parked_at) / s_frame_period));
+	}
+
+	s.next_frame = now;
+}
+
+void session_host::expire_idle(size_t worker)
+{
+	auto& idle = m_loops[worker].idle;
+	const auto now = session::clock::now();
+
+	for (size_t i = 0; i < idle.size();)
+	{
+		if (idle[i].due > now)
+		{
+			i++;
+			continue;
+		}
+
+		session_ptr s = std::move(idle[i].s);
+		const u64 park = idle[i].park;
+		idle[i] = std::move(idle.back());
+		idle.pop_back();
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+
+			// Submitted again by set_keys since (and possibly parked again)
+			if (!s->parked || s->park_count != park)
+			{
+				continue;
+			}
+
+			// Owned by this worker until hibernated or requeued
+			s->parked = false;
+		}
+
+		if (!s->closing && !hibernate(*s))
+		{
+			// Input arrived meanwhile, or the last one is not old enough yet
+			resume(*s);
+			requeue(worker, std::move(s));
+		}
+	}
+}
+
+bool session_host::hibernate(session& s)
+{
+	// Only sessions blocked on FX0A without input for a while
+	if (s.state->exit_code != exit_reason::key_wait || session::clock::now() - s.last_input.load() < m_hibernate_after)
+	{
+		return false;
+	}
+
+	auto snapshot = std::make_unique<state_snapshot>(state_snapshot::capture(*s.state));
+	std::unique_ptr<emu_state> state;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		// Input arrived during the capture, set_keys has seen the session as running
+		if (s.state->has_key_events)
+		{
+			return false;
+		}
+
+		state = std::move(s.state);
+		s.snapshot = std::move(snapshot);
+		s.hibernated = true;
+	}
+
+	s.hibernations++;
+	return true;
+}
+
+void session_host::requeue(size_t worker, session_ptr s)
+{
+	if (s->priority == session_priority::interactive)
+	{
+		const auto now = session::clock::now();
+
+		// Don't try to catch up after falling behind more than a frame
+		s->next_frame = std::max(s->next_frame + s_frame_period, now - s_frame_period);
+
+		if (s->next_frame > now)
+		{
+			// The worker's timer is armed for it before it waits again
+			auto& sleeping = m_loops[worker].sleeping;
+			sleeping.emplace_back(std::move(s));
+			std::push_heap(sleeping.begin(), sleeping.end(), later_frame);
+			return;
+		}
+	}
+
+	// Back to the worker's own queue, it picks it up again unless stolen
+	const size_t other = m_ready[s->priority == session_priority::interactive].size(worker);
+
+	if (m_ready[static_cast<size_t>(s->priority)].push(worker, std::move(s)) + other > 1)
+	{
+		// More than this worker takes next, idle workers blocked on the port would never steal the rest
+		wake();
+	}
+}
+
+bool session_host::pick(size_t worker, session_ptr& out)
+{
+	expire_idle(worker);
+
+	const auto now = session::clock::now();
+	auto& sleeping = m_loops[worker].sleeping;
+
+	// Wake interactive sessions whose frame is due
+	for (bool first = true; !sleeping.empty() && sleeping.front()->next_frame <= now; first = false)
+	{
+		std::pop_heap(sleeping.begin(), sleeping.end(), later_frame);
+		m_ready[0].push(worker, std::move(sleeping.back()));
+		sleeping.pop_back();
+
+		// This worker takes one, idle workers may steal the others
+		if (!first)
+		{
+			wake();
+		}
+	}
+
+	// Interactive first, then batch
+	return m_ready[0].pop(worker, out) || m_ready[1].pop(worker, out);
+}
+
+void session_host::run_slice(session& s)
+{
+	ULONG64 cycles_start = 0, cycles_end = 0;
+	::QueryThreadCycleTime(::GetCurrentThread(), &cycles_start);
+	const auto start = session::clock::now();
+
+	// One frame worth of instructions, then yield
+	const exit_reason reason = s.state->run_frame(s.inst_per_frame);
+
+	::QueryThreadCycleTime(::GetCurrentThread(), &cycles_end);
+	s.cpu_cycles += cycles_end - cycles_start;
+	s.cpu_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(session::clock::now() - start).count();
+	s.slices++;
+
+	if (reason != exit_reason::none && reason != exit_reason::key_wait)
+	{
+		s.reason = reason;
+		s.finished = true;
+	}
+}
+
+bool session_host::wait_for_work(size_t worker, session_ptr& out)
+{
+	auto& loop = m_loops[worker];
+
+	while (true)
+	{
+		// Checked first, sessions that always requeue themselves would keep the worker busy forever
+		if (m_stop)
+		{
+			loop.sleeping.clear();
+			loop.idle.clear();
+			return false;
+		}
+
+		if (pick(worker, out))
+		{
+			return true;
+		}
+
+		// Next frame of a sleeping session or hibernation of a parked one, whichever comes first
+		auto due = loop.sleeping.empty() ? session::clock::time_point::max() : loop.sleeping.front()->next_frame;
+
+		for (const auto& idle : loop.idle)
+		{
+			due = std::min(due, idle.due);
+		}
+
+		if (due != session::clock::time_point::max())
+		{
+			// Relative due time in 100ns units (negative)
+			const auto wait = std::max(due - session::clock::now(), session::clock::duration::zero());
+			LARGE_INTEGER due;
+			due.QuadPart = -std::max<LONGLONG>(std::chrono::duration_cast<std::chrono::nanoseconds>(wait).count() / 100, 1);
+			::SetWaitableTimer(loop.timer, &due, 0, on_frame_timer, nullptr, FALSE);
+		}
+
+		// Alertable wait for one packet (new work, shutdown) or the timer, a worker never holds more than one packet
+		OVERLAPPED_ENTRY entry;
+		ULONG removed = 0;
+		::GetQueuedCompletionStatusEx(m_port, &entry, 1, &removed, INFINITE, TRUE);
+	}
+}
+
+void session_host::worker_loop(size_t worker)
+{
+	for (session_ptr s; wait_for_work(worker, s);)
+	{
+		if (s->closing)
+		{
+			s.reset();
+			continue;
+		}
+
+		run_slice(*s);
+
+		// Sessions blocked on FX0A leave the queues until set_keys submits them again
+		if (!s->finished && !(s->state->exit_code == exit_reason::key_wait && park(worker, s)))
+		{
+			requeue(worker, std::move(s));
+		}
+
+		s.reset();
+	}
+}
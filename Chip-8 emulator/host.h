@@ -0,0 +1,131 @@
+#pragma once
+#include "emucore.h"
+#include "snapshot.h"
+#include "workqueue.h"
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Scheduling class of a hosted session
+enum class session_priority : u8
+{
+	interactive = 0, // Paced at 60hz, always picked before batch sessions
+	batch, // Runs as fast as the remaining capacity allows
+};
+
+// Emulator instance multiplexed onto the host's worker threads
+struct session
+{
+	using clock = std::chrono::steady_clock;
+
+	// Null while hibernated
+	std::unique_ptr<emu_state> state;
+	session_priority priority = session_priority::batch;
+	u32 inst_per_frame = 15;
+
+	// Keys last set by session_host::set_keys (bit n = key n), the state sees their changes as events at frame boundaries
+	std::atomic<u16> keys{0};
+	std::atomic<clock::time_point> last_input{};
+
+	// Compressed state while hibernated (guarded by the host mutex)
+	std::unique_ptr<state_snapshot> snapshot;
+	bool hibernated = false;
+
+	// Blocked on FX0A without pending input: in no queue until set_keys submits it again (guarded by the host mutex)
+	bool parked = false;
+	u64 park_count = 0;
+	clock::time_point parked_at{};
+
+	// Wall time the next frame is due (interactive only, sleeping in the heap of the worker that ran it last)
+	clock::time_point next_frame{};
+
+	// CPU accounting (updated by the worker after each slice)
+	std::atomic<u64> cpu_cycles{0};
+	std::atomic<u64> cpu_ns{0};
+	std::atomic<u64> slices{0};
+	std::atomic<u64> hibernations{0};
+
+	// Time spent restoring hibernated state on input (total and worst case, the latter should stay under 1ms)
+	std::atomic<u64> restore_ns{0};
+	std::atomic<u64> max_restore_ns{0};
+
+	// Set when the program left with an error or halted, the session is not scheduled anymore
+	std::atomic<bool> finished{false};
+	std::atomic<exit_reason> reason{exit_reason::none};
+
+	// Set by session_host::close
+	std::atomic<bool> closing{false};
+};
+
+class session_host
+{
+public:
+	struct settings_t
+	{
+		size_t workers = 0; // All cores if zero
+		bool pin_threads = false; // Pin worker n to logical cpu n
+		std::chrono::milliseconds hibernate_after{0}; // Idle time waiting for a key before hibernating (never if zero, parked sessions use no CPU either way)
+	};
+
+	explicit session_host(const settings_t& settings);
+	~session_host();
+
+	// The state must be reset, loaded and headless (frame sink is called from worker threads)
+	std::shared_ptr<session> open(std::unique_ptr<emu_state> state, session_priority priority, u32 inst_per_frame);
+	void close(const std::shared_ptr<session>& s);
+
+	// Keys held by the session (bit n = key n), wakes it up if parked or hibernated
+	void set_keys(const std::shared_ptr<session>& s, u16 keys);
+
+private:
+	using session_ptr = std::shared_ptr<session>;
+
+	// Event loop state owned by a worker thread
+	struct worker_t
+	{
+		// Waitable timer armed for the earliest sleeping session, its APC ends the worker's wait
+		HANDLE timer = nullptr;
+
+		// Interactive sessions waiting for their next frame (min-heap by due time)
+		std::vector<session_ptr> sleeping;
+
+		// Sessions parked by this worker, hibernated when still parked (same park) at their due time
+		struct idle_t
+		{
+			session_ptr s;
+			u64 park;
+			session::clock::time_point due;
+		};
+
+		std::vector<idle_t> idle;
+	};
+
+	void worker_loop(size_t worker);
+	bool pick(size_t worker, session_ptr& out);
+	bool wait_for_work(size_t worker, session_ptr& out);
+	void run_slice(session& s);
+	void requeue(size_t worker, session_ptr s);
+	void submit(session_ptr s);
+	void wake();
+	bool park(size_t worker, const session_ptr& s);
+	void resume(session& s);
+	void expire_idle(size_t worker);
+	bool hibernate(session& s);
+
+	// Ready sessions by priority
+	work_stealing_queue<session_ptr> m_ready[2];
+
+	// Workers block on the port, every packet (new work, shutdown) wakes one of them
+	HANDLE m_port = nullptr;
+	std::unique_ptr<worker_t[]> m_loops;
+
+	// Guards parking and hibernation against set_keys (and posting to the state it moves)
+	std::mutex m_mutex;
+	std::vector<std::thread> m_workers;
+	std::atomic<size_t> m_next_worker{0};
+	std::atomic<bool> m_stop{false};
+	std::chrono::milliseconds m_hibernate_after;
+};
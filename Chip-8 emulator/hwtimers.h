@@ -1,2 +0,0 @@
-#pragma once
-void timerJob();
\ No newline at end of file
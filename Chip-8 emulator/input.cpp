@@ -1,4 +1,8 @@
 #include "input.h"
+#include "emucore.h"
+
+// WaitOnAddress
+#pragma comment(lib, "Synchronization.lib")
 
 namespace input
 {
@@ -16,20 +20,53 @@ namespace input
 		return keyIDs[keyid];
 	};
 
-	u8 WaitForPress()
+	void OnHostKey(int keyid, bool down)
 	{
-		// May need perf tuning (use an OS's blocking method)
+		for (u32 i = 0; i < std::size(keyIDs); i++)
+		{
+			if (loadKeyID(i) == keyid)
+			{
+				g_state.post_key(zext<u8>(i), down, g_state.current_tick());
+			}
+		}
+	}
+
+	// Park the thread until the keys differ from 'seen'
+	static void WaitForChange(std::atomic<u16>& keys, u16 seen)
+	{
+		while (keys.load() == seen)
+		{
+			// Woken by post_key (window events are pumped by the presenter)
+			::WaitOnAddress(&keys, &seen, sizeof(seen), INFINITE);
+		}
+	}
+
+	u8 WaitForPress(std::atomic<u16>& keys)
+	{
+		// Wait for a key going down (keys already held don't count until pressed again)
+		u16 prev = keys.load();
+		u8 key;
+
 		while (true)
 		{
-			for (size_t i = 0; i < std::size(keyIDs); i++)
+			WaitForChange(keys, prev);
+			const u16 held = keys.load();
+
+			if (const u16 pressed = held & ~prev)
 			{
-				if (TestKeyState(i))
-				{
-					return zext<u8>(i);
-				}
+				key = zext<u8>(_tzcnt_u32(pressed));
+				break;
 			}
 
-			std::this_thread::yield();
+			prev = held;
 		}
+
+		// The COSMAC VIP returns the key once released
+		for (u16 held = keys.load(); held & (1u << key); held = keys.load())
+		{
+			WaitForChange(keys, held);
+		}
+
+		return key;
 	};
 };
\ No newline at end of file
@@ -17,5 +17,9 @@ namespace input
 		return (TestKeyStateImpl(keyids) || ...);
 	}
 
-	u8 WaitForPress();
+	// Post a host key event to the emulator (keys not mapped to chip-8 keys are ignored)
+	void OnHostKey(int keyid, bool down);
+
+	// FX0A: block until a key of the mask is pressed and released, returns the key
+	u8 WaitForPress(std::atomic<u16>& keys);
 };
\ No newline at end of file
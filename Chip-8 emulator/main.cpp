@@ -1,8 +1,8 @@
 // Chip-8 emulator
 //
 #include "render.h"
+#include "termrender.h"
 #include "emucore.h"
-#include "hwtimers.h"
 #include "input.h"
 #include "ASMJIT/AsmInterpreter.h"
 #include <iostream>
@@ -10,6 +10,7 @@
 #include <string_view>
 #include <filesystem>
 #include <cstdio>
+#include <cstdlib>
 #include <immintrin.h>
 
 namespace fs = std::filesystem;
@@ -87,53 +88,79 @@ void emu_state::load_exec()
 	system("Cls");
 	wprintf(display_buf);
 
+	// Block on console key events (auto-repeat included) instead of polling the keyboard
+	const HANDLE console = ::GetStdHandle(STD_INPUT_HANDLE);
 	const wchar_t* rom = {};
-	for (size_t index = 0;;)
+
+	for (size_t index = 0; !rom;)
 	{
-		if (input::TestKeyState(VK_RETURN))
+		INPUT_RECORD record;
+		DWORD count = 0;
+
+		if (!::ReadConsoleInputW(console, &record, 1, &count) || !count)
+		{
+			return failure();
+		}
+
+		if (record.EventType != KEY_EVENT || !record.Event.KeyEvent.bKeyDown)
+		{
+			continue;
+		}
+
+		const size_t old = index;
+
+		switch (record.Event.KeyEvent.wVirtualKeyCode)
+		{
+		case VK_RETURN:
 		{
 			// Enter pressed, rom selected
 			rom = files[index].c_str();
 			is_super = index >= s8_min;
 			break;
 		}
-		bool update = false;
-
-		if (input::TestKeyState(VK_UP, 0x57))
+		case VK_UP:
+		case 0x57:
 		{
-			Sleep(50); // Hack, simulate key press events
-			display_buf[(line_offset + index) * 65] = ' ';
-			update = true;
-
-			if (index != 0)
-			{
-				index--;
-			}
-			else
-			{
-				index = names.size() - 1;
-			}
+			index = (index ? index : names.size()) - 1;
+			break;
 		}
-		else if (input::TestKeyState(VK_DOWN, 0x53))
+		case VK_DOWN:
+		case 0x53:
 		{
-			Sleep(50); // Hack, simulate key press events
-			display_buf[(line_offset + index) * 65] = ' ';
-			update = true;
-			index++;
-			index %= names.size();
+			index = (index + 1) % names.size();
+			break;
+		}
+		default: break;
 		}
 
-		if (update)
+		if (index != old)
 		{
+			display_buf[(line_offset + old) * 65] = ' ';
 			display_buf[(line_offset + index) * 65] = '>';
 			system("Cls");
 			wprintf(display_buf);
 		}
-
-		Sleep(2);
 	}
 
 	system("Cls");
+
+	// Compatibility profile of the image kind, CHIP8_QUIRKS overrides it (vip, chip8 or schip)
+	quirks = is_super ? quirk_profile::schip() : quirk_profile::chip8();
+
+	if (const char* env = std::getenv("CHIP8_QUIRKS"))
+	{
+		quirk_profile::find(env, quirks);
+	}
+
+	// CHIP8_TIMING=vip charges instructions their COSMAC VIP cost and paces frames against the virtual clock
+	if (const char* env = std::getenv("CHIP8_TIMING"))
+	{
+		vip_timing = !std::strcmp(env, "vip");
+	}
+
+	// Reset state and compile the instruction table for the selected image
+	reset();
+
 	std::basic_ifstream<u8> file(rom, std::ifstream::binary);
 
 	if (!file) 
@@ -154,7 +181,7 @@ void emu_state::load_exec()
 	}
 
 	// Executable load start address is 0x200
-	file.read(g_state.ptr<u8>(0x200), zext<std::streamsize>(length));
+	file.read(this->ptr<u8>(0x200), zext<std::streamsize>(length));
 }
 
 void handle_all_errors()
@@ -167,15 +194,70 @@ void handle_all_errors()
 int main()
 {
 	// Load rom, reset state and compile the instruction table
-	g_state.reset();
+	g_state.load_exec();
+
+	// CHIP8_DISPLAY=terminal (half blocks) or braille draws on the console instead of a window, CHIP8_TERM_FPS caps its updates (default: 20)
+	const char* display = std::getenv("CHIP8_DISPLAY");
+	const bool terminal = display && (!std::strcmp(display, "terminal") || !std::strcmp(display, "braille"));
+	const term_glyphs glyphs = terminal && !std::strcmp(display, "braille") ? term_glyphs::braille : term_glyphs::half_block;
+
+	// Framebuffer is handed to the presenter thread
+	g_state.frame_sink = terminal ? &PublishTerminalFrame : &PublishFrame;
+
+	if (!terminal)
+	{
+		// Open graphics window and close console
+		InitWindow();
+	}
+
+	// Asm code takes over on its own thread, draws never wait for the display
+	std::thread([]()
+	{
+		exit_reason reason;
+
+		if (g_state.vip_timing)
+		{
+			// One virtual frame per 60hz tick of the wall clock
+			const auto period = std::chrono::steady_clock::duration(std::chrono::seconds(1)) / 60;
+			auto start = std::chrono::steady_clock::now();
+
+			while ((reason = g_state.run_frame(0)) == exit_reason::none)
+			{
+				const auto now = std::chrono::steady_clock::now();
 
-	// Open graphics window and close console
-	InitWindow();
+				// Don't try to catch up after falling behind more than a frame (FX0A waits, stalls)
+				if (now - (start + g_state.frame_count * period) > period)
+				{
+					start = now - g_state.frame_count * period;
+				}
 
-	// Asm code now takes over
-	asm_insts::entry();
+				std::this_thread::sleep_until(start + g_state.frame_count * period);
+			}
+		}
+		else
+		{
+			while ((reason = g_state.run(UINT32_MAX)) == exit_reason::none) {}
+		}
+
+		if (reason != exit_reason::halted)
+		{
+			// Print last error if there is one
+			handle_all_errors();
+
+			// The main thread is still presenting, static destructors would tear down GL and the frame buffers under it
+			std::fflush(stdout);
+			std::quick_exit(0);
+		}
+
+		// Halted: the last frame stays on screen until the window is closed
+	}).detach();
+
+	if (terminal)
+	{
+		const char* fps = std::getenv("CHIP8_TERM_FPS");
+		RunTerminal(glyphs, fps ? static_cast<u32>(std::strtoul(fps, nullptr, 10)) : 20);
+	}
 
-	// Print last error if there is one
-	handle_all_errors();
-	return 0;
+	// GLFW windows and events belong to the main thread
+	RunPresenter();
 }
@@ -0,0 +1,55 @@
+#pragma once
+#include "utils.h"
+
+#include <cstring>
+
+// Behaviors differing between chip-8 interpreters
+// Generated code is compiled per profile, so a profile costs nothing at run time
+struct quirk_profile
+{
+	// 8XY6/8XYE: shift VY into VX, otherwise VX is shifted in place
+	bool shift_vy;
+	// FX55/FX65: I is left past the last register (SCHIP ROMs enable it with 00FA)
+	bool index_increment;
+	// DRW: sprites wrap around the bottom edge, otherwise they are clipped
+	bool draw_wrap;
+	// 8XY1/8XY2/8XY3: VF is reset
+	bool vf_reset;
+	// BNNN: jump to NNN + VX (X is the top digit of NNN), otherwise NNN + V0
+	bool jump_vx;
+	// DRW: wait for the next frame
+	bool display_wait;
+
+	// Original COSMAC VIP interpreter
+	static constexpr quirk_profile vip()
+	{
+		return { true, true, false, true, false, true };
+	}
+
+	// Defaults of this emulator for chip-8 images
+	static constexpr quirk_profile chip8()
+	{
+		return { false, true, false, false, false, false };
+	}
+
+	// SCHIP 1.1
+	static constexpr quirk_profile schip()
+	{
+		return { false, false, false, false, true, false };
+	}
+
+	// Find a profile by name, returns false if unknown
+	static bool find(const char* name, quirk_profile& out)
+	{
+		if (!std::strcmp(name, "vip")) return out = vip(), true;
+		if (!std::strcmp(name, "chip8")) return out = chip8(), true;
+		if (!std::strcmp(name, "schip")) return out = schip(), true;
+		return false;
+	}
+
+	// Compact key of the profile
+	u32 bits() const
+	{
+		return u32{shift_vy} | u32{index_increment} << 1 | u32{draw_wrap} << 2 | u32{vf_reset} << 3 | u32{jump_vx} << 4 | u32{display_wait} << 5;
+	}
+};
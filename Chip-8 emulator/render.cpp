@@ -1,5 +1,6 @@
 #include "render.h"
 #include "emucore.h"
+#include "input.h"
 
 // static vertex array ID
 static GLuint sVertexArrayID;
@@ -7,6 +8,23 @@ static GLuint sVertexbuffer, sTexCoordsbuffer;
 
 static GLFWwindow* window = {};
 
+triple_buffer<frame_image> g_frames;
+
+// Sequence number of the frame the presenter took last
+static std::atomic<u64> s_presented_seq{0};
+
+// Packed lines of a frame (see emu_state::copy_framebuffer), one slot per triple buffer slot
+static constexpr u32 s_slot_size = sizeof(u64) * 2 * emu_state::y_size_ex;
+
+// Persistently mapped pixel unpack buffer holding the slots (zero if unsupported, s_frame_memory is then plain memory)
+static GLuint s_pbo = 0;
+static u8* s_frame_memory = nullptr;
+
+// Signaled once the GPU is done reading a slot
+static GLsync s_fences[3] = {};
+
+static GLhandler s_texture;
+
 // Triangle strip forming a rectangle
 const GLfloat s_vertex_buffer_data[] =
 {
@@ -54,9 +72,19 @@ void InitWindow()
 		glfwMakeContextCurrent(NULL); // Unuse currect context
 		glfwDestroyWindow(wnd); // Free context
 		glfwTerminate(); // GLFW cleanup
-		g_state.terminate = true; // Signal timers thread
-		g_state.hwtimers->join(); // join
-		std::exit(0); // Actually exit
+
+		// The emulation thread may still be running generated code, static destructors would unmap its memory under it
+		std::quick_exit(0);
+	});
+
+	// Key events feed the held keys (FX0A parks on them)
+	// GLFW codes of letters and digits are the virtual-key codes of input::keyIDs
+	glfwSetKeyCallback(window, [](GLFWwindow*, int key, int, int action, int)
+	{
+		if (action != GLFW_REPEAT)
+		{
+			input::OnHostKey(key, action == GLFW_PRESS);
+		}
 	});
 
 	glfwMakeContextCurrent(window); // Initialize GLEW
@@ -85,6 +113,45 @@ void InitWindow()
 	glGenBuffers(1, &sTexCoordsbuffer);
 	glBindBuffer(GL_ARRAY_BUFFER, sTexCoordsbuffer);
 	glBufferData(GL_ARRAY_BUFFER, sizeof(s_vertex_buffer_tex_data), s_vertex_buffer_tex_data, GL_STATIC_DRAW);
+
+	if (GLEW_ARB_buffer_storage)
+	{
+		// The emulation thread writes frames straight into the buffer, uploads are copies on the GPU side
+		const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glGenBuffers(1, &s_pbo);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, s_pbo);
+		glBufferStorage(GL_PIXEL_UNPACK_BUFFER, s_slot_size * 3, nullptr, flags);
+		s_frame_memory = static_cast<u8*>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, s_slot_size * 3, flags));
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+		if (glGetError() != GL_NO_ERROR || !s_frame_memory)
+		{
+			// Deleting the buffer unmaps it
+			glDeleteBuffers(1, &s_pbo);
+			s_frame_memory = nullptr;
+		}
+	}
+
+	if (!s_frame_memory)
+	{
+		// Uploads are copied from client memory when called
+		s_pbo = 0;
+		s_frame_memory = new u8[s_slot_size * 3];
+	}
+
+	// Buffer storage starts undefined, the screen starts clear
+	std::memset(s_frame_memory, 0, s_slot_size * 3);
+
+	// Allocated once for both modes: a 64 bit word of a line is two texels, the shader picks the pixels
+	load2DTexture(s_texture, 4, emu_state::y_size_ex, s_frame_memory + g_frames.front_index() * s_slot_size, GL_UNSIGNED_INT, GL_R32UI, GL_RED_INTEGER);
+
+	// Core profiles reject legacy enums (Mesa's llvmpipe with LIBGL_ALWAYS_SOFTWARE=1 included)
+	if (const GLenum error = glGetError())
+	{
+		ShowWindow(GetConsoleWindow(), SW_SHOW);
+		printf("Failed to create the framebuffer texture (GL error 0x%04x)\n", error);
+		hwBpx();
+	}
 }
 
 // No real need to load from files
@@ -114,12 +181,19 @@ const char s_default_fragment_shader[] =
 "out vec3 color;\n"
 
 // Values that stay constant for the whole mesh.
-"uniform sampler2D TextureSampler;\n"
+// Packed lines (see emu_state::copy_framebuffer), a texel is a half of a 64 bit word
+"uniform usampler2D TextureSampler;\n"
+// Visible size in pixels
+"uniform ivec2 Size;\n"
 
 "void main() {\n"
+"	ivec2 p = min(ivec2(UV * vec2(Size)), Size - 1);\n"
+
+// Little endian words: the high half (leftmost pixels) comes second
+"	uint word = texelFetch(TextureSampler, ivec2((p.x >> 6) * 2 + ((p.x & 63) < 32 ? 1 : 0), p.y), 0).r;\n"
 
-// Output color = tex[UV].red -> rgb
-"	color = vec3(texture(TextureSampler, UV).r);\n"
+// Output color = pixel bit (MSB first) -> rgb
+"	color = vec3(float((word >> uint(31 - (p.x & 31))) & 1u));\n"
 "}"
 ;
 
@@ -251,45 +325,98 @@ GLuint load2DTexture(GLhandler& handler, GLsizei width, GLsizei height, const vo
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 
 	// Set wrapping mode
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-	glGenerateMipmap(GL_TEXTURE_2D);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
 	return handler.id;
 }
 
-// Intermediate buffer for swizzled buffer translation
-static u8 interBuffer[emu_state::y_size_ex * emu_state::x_size_ex]{};
-
-void KickChip8Framebuffer(void* pixels)
+void PublishFrame(emu_state& state)
 {
-	// Translate swizzled buffer into raw rgba buffer
+	// Changed lines of each published frame, indexed by sequence number
+	static std::array<u64, 64> s_history{};
+	static u64 s_seq = 0;
+	static u64 s_last_hash = 0;
+
+	// A sprite drawn and erased again leaves the frame as it was published
+	const u64 hash = state.framebuffer_hash();
 
-	// Y0 is the original's buffer, y1 is the destination's
-	for (u32 y0 = 0, y1 = 0; y1 < emu_state::y_size * emu_state::x_size; y1 += emu_state::x_size, y0 += emu_state::y_stride)
+	if (s_seq && hash == s_last_hash)
 	{
-		// TODO: This can be further optimzed with asmjit
-		std::memcpy(interBuffer + y1, (u8*)pixels + y0, emu_state::x_size);
+		state.dirty_rows = 0;
+		return;
 	}
 
-	// Here we bind red channel only, but modify it in the fragment shader into black and white!
-	KickFramebuffer(emu_state::x_size, emu_state::y_size, interBuffer, GL_UNSIGNED_BYTE, GL_R8, GL_RED);
+	s_last_hash = hash;
+	const u64 seq = ++s_seq;
+	s_history[seq % s_history.size()] = std::exchange(state.dirty_rows, 0);
+
+	// Lines changed since the frame the presenter has (it may have taken a newer one meanwhile, uploading more is harmless)
+	const u64 presented = s_presented_seq.load(std::memory_order_relaxed);
+	u64 dirty = seq - presented > s_history.size() ? ~u64{0} : 0;
+
+	for (u64 i = presented + 1; ~dirty && i <= seq; i++)
+	{
+		dirty |= s_history[i % s_history.size()];
+	}
+
+	frame_image& frame = g_frames.back();
+	state.copy_framebuffer(reinterpret_cast<u64(*)[2]>(s_frame_memory + g_frames.back_index() * s_slot_size));
+	frame.extended = state.extended;
+	frame.seq = seq;
+	frame.dirty = dirty;
+	g_frames.publish();
 }
 
-void KickSChip8Framebuffer(void* pixels)
+// Upload the changed lines of the taken frame
+static void UploadFrame()
 {
-	for (u32 y0 = 0, y1 = 0; y1 < emu_state::y_size_ex * emu_state::x_size_ex; y1 += emu_state::x_size_ex, y0 += emu_state::y_stride)
+	const frame_image& frame = g_frames.front();
+	const u32 slot = g_frames.front_index();
+	const u32 height = frame.extended ? emu_state::y_size_ex : emu_state::y_size;
+
+	// Offsets into the bound buffer, or pointers into client memory
+	const uptr base = s_pbo ? 0 : reinterpret_cast<uptr>(s_frame_memory);
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, s_pbo);
+	glBindTexture(GL_TEXTURE_2D, s_texture.id);
+
+	// One sub-image per run of changed lines
+	u64 rows = height < 64 ? frame.dirty & ((u64{1} << height) - 1) : frame.dirty;
+
+	while (rows)
 	{
-		// TODO: This can be further optimzed with asmjit
-		std::memcpy(interBuffer + y1, (u8*)pixels + y0, emu_state::x_size_ex);
+		const u32 first = static_cast<u32>(_tzcnt_u64(rows));
+		const u32 count = static_cast<u32>(_tzcnt_u64(~(rows >> first)));
+		const uptr offset = slot * s_slot_size + first * sizeof(u64) * 2;
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, first, 4, count, GL_RED_INTEGER, GL_UNSIGNED_INT, reinterpret_cast<const void*>(base + offset));
+		rows = count + first >= 64 ? 0 : rows & (~u64{0} << (first + count));
 	}
 
-	// Here we bind red channel only, but modify it in the fragment shader into black and white!
-	KickFramebuffer(emu_state::x_size_ex, emu_state::y_size_ex, interBuffer, GL_UNSIGNED_BYTE, GL_R8, GL_RED);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	if (s_pbo)
+	{
+		// The slot goes back to the producer on the next take, not before the copies read it
+		s_fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	}
+}
+
+// Wait for the GPU to finish reading the taken slot before handing it back
+static void ReleaseFrame()
+{
+	GLsync& fence = s_fences[g_frames.front_index()];
+
+	if (fence)
+	{
+		glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, UINT64_MAX);
+		glDeleteSync(fence);
+		fence = nullptr;
+	}
 }
 
 // TODO: Investigate vulkan implemntation
-void KickFramebuffer(GLsizei width, GLsizei height, const void *pixels, GLenum type, GLint internalformat, GLenum format)
+void DrawFramebuffer()
 {
 	static GLhandler Program;
 
@@ -317,21 +444,51 @@ void KickFramebuffer(GLsizei width, GLsizei height, const void *pixels, GLenum t
 		(void*)0            // array buffer offset
 	);
 
+	static GLint s_size_location = -1;
+	static bool s_extended = false;
+
 	if (Program.checkAndInit())
 	{
 		// Compile the program once
 		Program.id = LoadShaders(s_default_vertex_shader, s_default_fragment_shader);
+		s_size_location = glGetUniformLocation(Program.id, "Size");
+		s_extended = !g_frames.front().extended;
 	}
 
 	glUseProgram(Program.id);
+	glBindTexture(GL_TEXTURE_2D, s_texture.id);
 
-	static GLhandler texId;
-	load2DTexture(texId, width, height, pixels, type, internalformat, format);
+	if (g_frames.front().extended != s_extended)
+	{
+		s_extended = g_frames.front().extended;
+		glUniform2i(s_size_location, s_extended ? emu_state::x_size_ex : emu_state::x_size, s_extended ? emu_state::y_size_ex : emu_state::y_size);
+	}
 
 	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 	glDisableVertexAttribArray(0);
 	glDisableVertexAttribArray(1);
-	glfwSwapBuffers(window);
+}
+
+void RunPresenter()
+{
+	// Swapping waits for the display refresh, which paces the loop
+	glfwSwapInterval(1);
+
+	while (true)
+	{
+		glfwPollEvents();
+
+		ReleaseFrame();
 
-	glfwPollEvents(); // TODO: It must be executed unrelated to draws, possibly in a saperate thread
+		// Frames drawn since the last refresh are coalesced into the latest one
+		if (g_frames.take())
+		{
+			s_presented_seq.store(g_frames.front().seq, std::memory_order_relaxed);
+			UploadFrame();
+		}
+
+		DrawFramebuffer();
+
+		glfwSwapBuffers(window);
+	}
 }
\ No newline at end of file
@@ -3,11 +3,32 @@
 #include "../GLEW/glew.h"
 #include "../GLFW/glfw3.h"
 #include "utils.h"
+#include "triplebuffer.h"
+
+// Frame handed from the emulation thread to the presenter
+// Its lines are kept packed in the frame memory slot of the same index (see emu_state::copy_framebuffer)
+struct frame_image
+{
+	bool extended;
+	// Publishing order (starts at 1)
+	u64 seq;
+	// Lines changed since the last frame taken by the presenter (bit y = line y)
+	u64 dirty;
+};
+
+// Frames published by the emulation thread, the presenter shows the latest one
+extern triple_buffer<frame_image> g_frames;
+
+struct emu_state;
+
+// Frame sink of the windowed instance: publish the framebuffer unless identical to the last published one
+void PublishFrame(emu_state& state);
 
 void InitWindow();
-void KickChip8Framebuffer(void* pixels);
-void KickSChip8Framebuffer(void* pixels);
-void KickFramebuffer(GLsizei width, GLsizei height, const void *pixels, GLenum type, GLint internalformat, GLenum format);
+
+// Show the latest published frame at the display rate and pump window events (main thread, never returns)
+void RunPresenter();
+void DrawFramebuffer();
 
 GLuint LoadShaders(const char* vertex_shader, const char* fragment_shader);
 GLuint LoadShadersFromFiles(const wchar_t* vertex_file_path, const wchar_t* fragment_file_path);
@@ -0,0 +1,198 @@
+#include "snapshot.h"
+
+#include <cstring>
+
+// Serialized registers
+struct snapshot_regs
+{
+	u8 gpr[16];
+	u32 stack[16];
+	u32 sp;
+	u32 pc;
+	u32 index;
+	u8 delay;
+	u8 sound;
+	u16 key_state;
+	u8 reg_save[16];
+	u32 compatibilty;
+	u32 rng_state;
+	u64 inst_count;
+	u64 frame_count;
+	u64 cycles;
+	u64 sleep_period;
+	const char* last_error;
+	exit_reason exit_code;
+	bool extended;
+};
+
+void rle_encode(const u8* data, const u8* base, size_t size, std::vector<u8>& out)
+{
+	const auto at = [&](size_t i) -> u8
+	{
+		return base ? data[i] ^ base[i] : data[i];
+	};
+
+	const auto put16 = [&](size_t value)
+	{
+		out.push_back(static_cast<u8>(value));
+		out.push_back(static_cast<u8>(value >> 8));
+	};
+
+	// Pairs of (zero bytes to skip, literal bytes count) followed by the literals
+	for (size_t i = 0; i < size;)
+	{
+		size_t zeroes = 0;
+
+		while (i + zeroes < size && zeroes < UINT16_MAX && !at(i + zeroes))
+		{
+			zeroes++;
+		}
+
+		i += zeroes;
+
+		size_t literals = 0;
+
+		// Zero runs shorter than a pair header are cheaper as literals
+		while (i + literals < size && literals < UINT16_MAX && (at(i + literals) || (i + literals + 4 < size && (at(i + literals + 1) | at(i + literals + 2) | at(i + literals + 3)))))
+		{
+			literals++;
+		}
+
+		put16(zeroes);
+		put16(literals);
+
+		for (size_t j = 0; j < literals; j++)
+		{
+			out.push_back(at(i + j));
+		}
+
+		i += literals;
+	}
+}
+
+const u8* rle_decode(const u8* in, const u8* end, u8* data, size_t size)
+{
+	for (size_t i = 0; i < size;)
+	{
+		if (end - in < 4)
+		{
+			return nullptr;
+		}
+
+		const size_t zeroes = in[0] | (in[1] << 8);
+		const size_t literals = in[2] | (in[3] << 8);
+		in += 4;
+		i += zeroes;
+
+		if (i + literals > size || static_cast<size_t>(end - in) < literals)
+		{
+			return nullptr;
+		}
+
+		for (size_t j = 0; j < literals; j++, i++)
+		{
+			data[i] ^= *in++;
+		}
+	}
+
+	return in;
+}
+
+state_snapshot state_snapshot::capture(const emu_state& state)
+{
+	state_snapshot snap;
+	snap.image = state.image;
+	snap.frame_sink = state.frame_sink;
+	snap.is_super = state.is_super;
+	snap.quirks = state.quirks;
+	snap.headless = state.headless;
+	snap.vip_timing = state.vip_timing;
+
+	snapshot_regs regs{};
+	std::memcpy(regs.gpr, state.gpr, sizeof(regs.gpr));
+	std::memcpy(regs.stack, state.stack, sizeof(regs.stack));
+	std::memcpy(regs.reg_save, state.reg_save, sizeof(regs.reg_save));
+	regs.sp = state.sp;
+	regs.pc = state.pc;
+	regs.index = state.index;
+	regs.delay = state.delay_timer();
+	regs.sound = state.sound_timer();
+	regs.key_state = state.key_state;
+	regs.compatibilty = state.compatibilty;
+	regs.rng_state = state.rng_state;
+	regs.inst_count = state.inst_count;
+	regs.frame_count = state.frame_count;
+	regs.cycles = state.cycles;
+	regs.sleep_period = state.sleep_period;
+	regs.last_error = state.last_error;
+	regs.exit_code = state.exit_code;
+	regs.extended = state.extended;
+
+	snap.blob.resize(sizeof(regs));
+	std::memcpy(snap.blob.data(), &regs, sizeof(regs));
+
+	// Only pages written by the instance differ from the image
+	rle_encode(state.memBase, state.image->data(), guest_image::size, snap.blob);
+
+	// Lines are stored in screen order and lines cleared since last drawn as zero
+	// The restored state starts with a new epoch and no rotation
+	u64 gfx[emu_state::y_size_ex][2];
+	state.copy_framebuffer(gfx);
+
+	rle_encode(reinterpret_cast<const u8*>(gfx), nullptr, sizeof(gfx), snap.blob);
+
+	snap.blob.shrink_to_fit();
+	return snap;
+}
+
+std::unique_ptr<emu_state> state_snapshot::restore() const
+{
+	if (blob.size() < sizeof(snapshot_regs))
+	{
+		return nullptr;
+	}
+
+	auto state = std::make_unique<emu_state>();
+	state->is_super = is_super;
+	state->quirks = quirks;
+	state->headless = headless;
+	state->vip_timing = vip_timing;
+	state->frame_sink = frame_sink;
+	state->reset(image);
+
+	snapshot_regs regs;
+	std::memcpy(&regs, blob.data(), sizeof(regs));
+	std::memcpy(state->gpr, regs.gpr, sizeof(regs.gpr));
+	std::memcpy(state->stack, regs.stack, sizeof(regs.stack));
+	std::memcpy(state->reg_save, regs.reg_save, sizeof(regs.reg_save));
+	state->sp = regs.sp;
+	state->pc = regs.pc;
+	state->index = regs.index;
+	state->key_state = regs.key_state;
+	state->compatibilty = regs.compatibilty;
+	state->select_ops();
+	state->rng_state = regs.rng_state;
+	state->inst_count = regs.inst_count;
+	state->frame_count = regs.frame_count;
+	// Timers count from the restored tick
+	state->set_delay(regs.delay);
+	state->set_sound(regs.sound);
+	state->cycles = regs.cycles;
+	state->sleep_period = regs.sleep_period;
+	state->last_error = regs.last_error;
+	state->exit_code = regs.exit_code;
+	state->extended = regs.extended;
+
+	const u8* const end = blob.data() + blob.size();
+	const u8* in = blob.data() + sizeof(regs);
+
+	// The fresh view holds the image, pages untouched by the delta stay shared
+	in = rle_decode(in, end, state->memBase, guest_image::size);
+
+	if (!in || !rle_decode(in, end, reinterpret_cast<u8*>(state->gfxMemory), sizeof(state->gfxMemory)))
+	{
+		return nullptr;
+	}
+
+	return state;
+}
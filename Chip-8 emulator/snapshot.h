@@ -0,0 +1,29 @@
+#pragma once
+#include "emucore.h"
+
+#include <vector>
+
+// Compact copy of an instance
+// Guest memory is stored as a delta against its image and the framebuffer as zero runs, so idle instances take a few hundred bytes
+struct state_snapshot
+{
+	std::shared_ptr<guest_image> image;
+	void (*frame_sink)(emu_state&) = nullptr;
+	bool is_super = false;
+	quirk_profile quirks = quirk_profile::chip8();
+	bool headless = false;
+	bool vip_timing = false;
+	std::vector<u8> blob;
+
+	static state_snapshot capture(const emu_state& state);
+
+	// Create a new instance in the captured state
+	std::unique_ptr<emu_state> restore() const;
+};
+
+// Zero-run encoding of (data ^ base), base may be null
+void rle_encode(const u8* data, const u8* base, size_t size, std::vector<u8>& out);
+
+// XOR the encoded delta into data (which must hold the base), only bytes that differ are written
+// Returns the position after the encoded data, or nullptr if it is malformed
+const u8* rle_decode(const u8* in, const u8* end, u8* data, size_t size);
@@ -0,0 +1,87 @@
+#include "softrender.h"
+#include "emucore.h"
+
+#include <algorithm>
+#include <cstring>
+
+// One pixel at a time, for CPUs without AVX2
+static void render_line(const u64* line, u32 width, u32 scale, const palette_t& palette, u32* out)
+{
+	for (u32 x = 0; x < width; x++, out += scale)
+	{
+		std::fill_n(out, scale, (line[x / 64] >> (63 - x % 64)) & 1 ? palette.on : palette.off);
+	}
+}
+
+// 8 source pixels per step: the bits select palette colors, then each of the 'scale' output vectors permutes its pixels out of them
+static void render_line_avx2(const u64* line, u32 width, u32 scale, const palette_t& palette, const __m256i* index, u32* out)
+{
+	const __m256i select = _mm256_setr_epi32(0x80, 0x40, 0x20, 0x10, 0x8, 0x4, 0x2, 0x1);
+	const __m256i off = _mm256_set1_epi32(palette.off);
+	const __m256i on = _mm256_set1_epi32(palette.on);
+
+	for (u32 x = 0; x < width; x += 8)
+	{
+		const __m256i bits = _mm256_set1_epi32(static_cast<u32>(line[x / 64] >> (56 - x % 64)) & 0xff);
+		const __m256i colors = _mm256_blendv_epi8(off, on, _mm256_cmpeq_epi32(_mm256_and_si256(bits, select), select));
+
+		for (u32 i = 0; i < scale; i++, out += 8)
+		{
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(out), _mm256_permutevar8x32_epi32(colors, index[i]));
+		}
+	}
+}
+
+void render_rgba(const u64 (*lines)[2], u32 width, u32 height, u32 scale, const palette_t& palette, u32* out, size_t pitch)
+{
+	assert(scale >= 1 && scale <= max_render_scale);
+
+	const bool avx2 = get_cpu_features().level >= isa_level::avx2;
+
+	// Output vector i of a step holds source pixels (8 * i + n) / scale
+	__m256i index[max_render_scale];
+
+	for (u32 i = 0; avx2 && i < scale; i++)
+	{
+		alignas(32) u32 lanes[8];
+
+		for (u32 n = 0; n < 8; n++)
+		{
+			lanes[n] = (8 * i + n) / scale;
+		}
+
+		index[i] = _mm256_load_si256(reinterpret_cast<const __m256i*>(lanes));
+	}
+
+	for (u32 y = 0; y < height; y++)
+	{
+		u32* const row = out + y * scale * pitch;
+
+		if (avx2)
+		{
+			render_line_avx2(lines[y], width, scale, palette, index, row);
+		}
+		else
+		{
+			render_line(lines[y], width, scale, palette, row);
+		}
+
+		// Replicate the line vertically
+		for (u32 i = 1; i < scale; i++)
+		{
+			std::memcpy(row + i * pitch, row, width * scale * sizeof(u32));
+		}
+	}
+}
+
+void rgba_frame::render(const emu_state& state, u32 scale, const palette_t& palette)
+{
+	u64 lines[emu_state::y_size_ex][2];
+	state.copy_framebuffer(lines);
+
+	width = state.width() * scale;
+	height = state.height() * scale;
+	pixels.resize(size_t{width} * height);
+
+	render_rgba(lines, state.width(), state.height(), scale, palette, pixels.data(), width);
+}
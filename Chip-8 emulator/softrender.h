@@ -0,0 +1,36 @@
+#pragma once
+#include "utils.h"
+
+#include <vector>
+
+struct emu_state;
+
+// RGBA8 colors of the two pixel states, in memory order (R is the lowest byte)
+struct palette_t
+{
+	u32 off;
+	u32 on;
+
+	// Opaque black and white
+	static constexpr palette_t mono()
+	{
+		return { 0xff000000, 0xffffffff };
+	}
+};
+
+// Largest supported scale factor
+constexpr u32 max_render_scale = 16;
+
+// CPU renderer: expand packed lines (see emu_state::copy_framebuffer) to RGBA8 at an integer scale, no GPU needed
+// 'out' must hold height * scale lines of width * scale pixels, 'pitch' pixels apart
+void render_rgba(const u64 (*lines)[2], u32 width, u32 height, u32 scale, const palette_t& palette, u32* out, size_t pitch);
+
+// Plain RGBA8 image of the visible framebuffer (headless output, screenshots, capture)
+struct rgba_frame
+{
+	u32 width = 0;
+	u32 height = 0;
+	std::vector<u32> pixels;
+
+	void render(const emu_state& state, u32 scale, const palette_t& palette = palette_t::mono());
+};
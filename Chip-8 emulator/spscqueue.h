@@ -0,0 +1,59 @@
+#pragma once
+#include "utils.h"
+
+#include <atomic>
+
+// Lock-free ring from one producer to one consumer
+// Slots are filled and drained in place, so the ring doubles as a pool of preallocated buffers
+template <typename T, u32 Size>
+class spsc_queue
+{
+	static_assert((Size & (Size - 1)) == 0, "spsc_queue: size must be a power of 2");
+
+	T m_slots[Size]{};
+
+	// Slots pushed so far (written by the producer)
+	alignas(64) std::atomic<u32> m_head{0};
+
+	// Slots popped so far (written by the consumer)
+	alignas(64) std::atomic<u32> m_tail{0};
+
+public:
+	// Free slot to fill, null if the queue is full (producer)
+	T* prepare()
+	{
+		const u32 head = m_head.load(std::memory_order_relaxed);
+
+		if (head - m_tail.load(std::memory_order_acquire) == Size)
+		{
+			return nullptr;
+		}
+
+		return &m_slots[head % Size];
+	}
+
+	// Hand the prepared slot over (producer)
+	void push()
+	{
+		m_head.store(m_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	// Oldest pushed slot, null if the queue is empty (consumer)
+	T* front()
+	{
+		const u32 tail = m_tail.load(std::memory_order_relaxed);
+
+		if (tail == m_head.load(std::memory_order_acquire))
+		{
+			return nullptr;
+		}
+
+		return &m_slots[tail % Size];
+	}
+
+	// Give the front slot back to the producer (consumer)
+	void pop()
+	{
+		m_tail.store(m_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+};
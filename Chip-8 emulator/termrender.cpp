@@ -0,0 +1,219 @@
+#include "termrender.h"
+#include "emucore.h"
+#include "input.h"
+#include "triplebuffer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// Frame handed from the emulation thread to the terminal loop
+struct term_frame
+{
+	u64 lines[64][2];
+	bool extended;
+};
+
+static triple_buffer<term_frame> s_frames;
+
+static u32 pixel(const u64 (*lines)[2], u32 x, u32 y)
+{
+	return static_cast<u32>(lines[y][x / 64] >> (63 - x % 64)) & 1;
+}
+
+// Append the UTF-8 character of a cell
+static void put_cell(const u64 (*lines)[2], term_glyphs glyphs, u32 cx, u32 cy, std::string& out)
+{
+	if (glyphs == term_glyphs::half_block)
+	{
+		// Space, upper half, lower half and full block
+		static const char* const s_blocks[4] = { " ", "\xe2\x96\x80", "\xe2\x96\x84", "\xe2\x96\x88" };
+		out += s_blocks[pixel(lines, cx, cy * 2) | pixel(lines, cx, cy * 2 + 1) << 1];
+		return;
+	}
+
+	// Braille dots 1-8 (U+2800 + dots), columns of 3 dots then the bottom row
+	const u32 x = cx * 2, y = cy * 4;
+	const u32 dots = pixel(lines, x, y) | pixel(lines, x, y + 1) << 1 | pixel(lines, x, y + 2) << 2
+		| pixel(lines, x + 1, y) << 3 | pixel(lines, x + 1, y + 1) << 4 | pixel(lines, x + 1, y + 2) << 5
+		| pixel(lines, x, y + 3) << 6 | pixel(lines, x + 1, y + 3) << 7;
+
+	if (!dots)
+	{
+		out += ' ';
+		return;
+	}
+
+	out += '\xe2';
+	out += static_cast<char>(0xa0 | dots >> 6);
+	out += static_cast<char>(0x80 | (dots & 0x3f));
+}
+
+void term_renderer::render(const u64 (*lines)[2], bool extended, std::string& out)
+{
+	const u32 width = extended ? emu_state::x_size_ex : emu_state::x_size;
+	const u32 height = extended ? emu_state::y_size_ex : emu_state::y_size;
+	const u32 cell_width = m_glyphs == term_glyphs::braille ? 2 : 1;
+	const u32 cell_height = m_glyphs == term_glyphs::braille ? 4 : 2;
+
+	const bool full = !m_valid || extended != m_extended;
+
+	if (full)
+	{
+		// Hide the cursor and clear the screen
+		out += "\x1b[?25l\x1b[2J";
+	}
+
+	// Position of the terminal cursor (unknown at first)
+	u32 row = UINT32_MAX, col = 0;
+
+	for (u32 cy = 0; cy < height / cell_height; cy++)
+	{
+		// Pixel columns changed in the lines of the cell row
+		u64 diff[2]{};
+
+		for (u32 y = cy * cell_height; y < (cy + 1) * cell_height; y++)
+		{
+			diff[0] |= full ? ~u64{0} : lines[y][0] ^ m_lines[y][0];
+			diff[1] |= full ? ~u64{0} : lines[y][1] ^ m_lines[y][1];
+		}
+
+		if (!diff[0] && !(extended && diff[1]))
+		{
+			continue;
+		}
+
+		for (u32 cx = 0; cx < width / cell_width; cx++)
+		{
+			const u32 x = cx * cell_width;
+
+			if (!((diff[x / 64] >> (64 - cell_width - x % 64)) & ((1u << cell_width) - 1)))
+			{
+				continue;
+			}
+
+			if (row == cy && cx - col <= 2)
+			{
+				// Rewriting a short gap is shorter than moving the cursor
+				for (; col < cx; col++)
+				{
+					put_cell(lines, m_glyphs, col, cy, out);
+				}
+			}
+			else if (row != cy || col != cx)
+			{
+				char seq[16];
+				out.append(seq, std::snprintf(seq, sizeof(seq), "\x1b[%u;%uH", cy + 1, cx + 1));
+			}
+
+			put_cell(lines, m_glyphs, cx, cy, out);
+			row = cy;
+			col = cx + 1;
+		}
+	}
+
+	std::memcpy(m_lines, lines, sizeof(m_lines));
+	m_valid = true;
+	m_extended = extended;
+}
+
+void PublishTerminalFrame(emu_state& state)
+{
+	term_frame& frame = s_frames.back();
+	state.copy_framebuffer(frame.lines);
+	frame.extended = state.extended;
+	state.dirty_rows = 0;
+	s_frames.publish();
+}
+
+// Console settings found at startup
+static HANDLE s_output;
+static DWORD s_output_mode;
+static UINT s_output_cp;
+
+// Show the cursor again and leave the console as found
+static void restore_console()
+{
+	DWORD written = 0;
+	::WriteFile(s_output, "\x1b[?25h", 6, &written, nullptr);
+	::SetConsoleMode(s_output, s_output_mode);
+	::SetConsoleOutputCP(s_output_cp);
+}
+
+static BOOL WINAPI on_console_ctrl(DWORD)
+{
+	restore_console();
+
+	// Let the default handler terminate the process
+	return FALSE;
+}
+
+void RunTerminal(term_glyphs glyphs, u32 max_fps)
+{
+	const HANDLE input = ::GetStdHandle(STD_INPUT_HANDLE);
+	const HANDLE output = ::GetStdHandle(STD_OUTPUT_HANDLE);
+
+	s_output = output;
+	s_output_cp = ::GetConsoleOutputCP();
+	::GetConsoleMode(output, &s_output_mode);
+
+	// Ctrl+C or closing the console, or the program leaving through std::exit or std::quick_exit
+	::SetConsoleCtrlHandler(on_console_ctrl, TRUE);
+	std::atexit(restore_console);
+	std::at_quick_exit(restore_console);
+
+	// Escape sequences and UTF-8 output
+	::SetConsoleMode(output, s_output_mode | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+	::SetConsoleOutputCP(CP_UTF8);
+
+	const auto period = std::chrono::steady_clock::duration(std::chrono::seconds(1)) / std::max<u32>(max_fps, 1);
+	auto next = std::chrono::steady_clock::now();
+
+	term_renderer renderer(glyphs);
+	std::string out;
+
+	while (true)
+	{
+		// Key events until the next update is due, frames published meanwhile are coalesced into the latest one
+		while (true)
+		{
+			const auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next - std::chrono::steady_clock::now()).count();
+
+			if (wait <= 0 || ::WaitForSingleObject(input, static_cast<DWORD>(wait)) != WAIT_OBJECT_0)
+			{
+				break;
+			}
+
+			INPUT_RECORD records[16];
+			DWORD count = 0;
+			::ReadConsoleInputW(input, records, 16, &count);
+
+			for (DWORD i = 0; i < count; i++)
+			{
+				if (records[i].EventType == KEY_EVENT)
+				{
+					input::OnHostKey(records[i].Event.KeyEvent.wVirtualKeyCode, records[i].Event.KeyEvent.bKeyDown != FALSE);
+				}
+			}
+		}
+
+		// Don't try to catch up after falling behind
+		next = std::max(next + period, std::chrono::steady_clock::now());
+
+		if (!s_frames.take())
+		{
+			continue;
+		}
+
+		out.clear();
+		renderer.render(s_frames.front().lines, s_frames.front().extended, out);
+
+		if (!out.empty())
+		{
+			DWORD written = 0;
+			::WriteFile(output, out.data(), static_cast<DWORD>(out.size()), &written, nullptr);
+		}
+	}
+}
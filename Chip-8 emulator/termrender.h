@@ -0,0 +1,47 @@
+#pragma once
+#include "utils.h"
+
+#include <string>
+
+struct emu_state;
+
+// Characters used for the display cells
+enum class term_glyphs : u8
+{
+	half_block, // 1x2 pixels per cell (64x16 or 128x32 cells)
+	braille, // 2x4 pixels per cell (32x8 or 64x16 cells)
+};
+
+// Draws the display on a VT terminal (UTF-8), for monitoring over slow links
+// Only cells changed since the last update are written, the cursor is moved over unchanged runs
+class term_renderer
+{
+public:
+	explicit term_renderer(term_glyphs glyphs)
+		: m_glyphs(glyphs)
+	{
+	}
+
+	// Append the update from the last rendered frame to the packed lines given (see emu_state::copy_framebuffer), nothing if unchanged
+	void render(const u64 (*lines)[2], bool extended, std::string& out);
+
+	// Redraw everything on the next update (the terminal was cleared)
+	void invalidate()
+	{
+		m_valid = false;
+	}
+
+private:
+	term_glyphs m_glyphs;
+	bool m_valid = false;
+	bool m_extended = false;
+
+	// Lines of the last rendered frame
+	u64 m_lines[64][2]{};
+};
+
+// Frame sink of the terminal display
+void PublishTerminalFrame(emu_state& state);
+
+// Draw published frames on the console at most 'max_fps' times per second and feed it key events (main thread, never returns)
+void RunTerminal(term_glyphs glyphs, u32 max_fps);
@@ -0,0 +1,66 @@
+#pragma once
+#include "utils.h"
+
+#include <atomic>
+
+// Lock-free mailbox from one producer to one consumer holding the latest value
+// The producer fills its back slot and publishes it, the consumer takes the latest published slot
+// Neither side ever waits, values published while the consumer is busy are dropped (only the latest is shown)
+template <typename T>
+class triple_buffer
+{
+	static constexpr u8 fresh_bit = 4;
+
+	T m_slots[3]{};
+
+	// Published slot index, with fresh_bit set until the consumer takes it
+	alignas(64) std::atomic<u8> m_ready{0};
+
+	// Owned by the producer
+	alignas(64) u8 m_back = 1;
+
+	// Owned by the consumer
+	alignas(64) u8 m_front = 2;
+
+public:
+	// Slot to fill before publishing (producer)
+	T& back()
+	{
+		return m_slots[m_back];
+	}
+
+	// Hand the back slot over, the previously published slot becomes the new back slot (producer)
+	void publish()
+	{
+		m_back = m_ready.exchange(m_back | fresh_bit, std::memory_order_acq_rel) & ~fresh_bit;
+	}
+
+	// Take the latest published slot, returns false if nothing was published since the last call (consumer)
+	bool take()
+	{
+		if (!(m_ready.load(std::memory_order_relaxed) & fresh_bit))
+		{
+			return false;
+		}
+
+		m_front = m_ready.exchange(m_front, std::memory_order_acq_rel) & ~fresh_bit;
+		return true;
+	}
+
+	// Last taken slot (consumer)
+	const T& front() const
+	{
+		return m_slots[m_front];
+	}
+
+	// Slot indices, for data kept outside of the buffer in slots of its own (owners as above)
+	u8 back_index() const
+	{
+		return m_back;
+	}
+
+	u8 front_index() const
+	{
+		return m_front;
+	}
+};
@@ -1,15 +1,62 @@
 #include "utils.h"
+#include <string_view>
 
-// Check if CPU has AVX support (taken from https://github.com/RPCS3/rpcs3/blob/master/Utilities/sysinfo.cpp#L29)
-bool has_avx()
+const char* isa_level_name(isa_level level)
 {
-	static const bool g_value = get_cpuid(0, 0)[0] >= 0x1 && get_cpuid(1, 0)[2] & 0x10000000 && (get_cpuid(1, 0)[2] & 0x0C000000) == 0x0C000000 && (_xgetbv(0) & 0x6) == 0x6;
-	return g_value;
+	switch (level)
+	{
+	case isa_level::sse2: return "sse2";
+	case isa_level::avx2: return "avx2";
+	case isa_level::avx512: return "avx512";
+	}
+
+	return "?";
+}
+
+static cpu_features detect_cpu_features()
+{
+	cpu_features res{};
+
+	const u32 max_leaf = get_cpuid(0, 0)[0];
+	const auto leaf1 = get_cpuid(1, 0);
+	const auto leaf7 = max_leaf >= 7 ? get_cpuid(7, 0) : std::array<u32, 4>{};
+
+	// OS support of ymm/zmm state (taken from https://github.com/RPCS3/rpcs3/blob/master/Utilities/sysinfo.cpp#L29)
+	const bool osxsave = (leaf1[2] & 0x08000000) != 0;
+	const u64 xcr0 = osxsave ? _xgetbv(0) : 0;
+	const bool avx = (leaf1[2] & 0x10000000) && (xcr0 & 0x6) == 0x6;
+	const bool avx2 = avx && (leaf7[1] & 0x20);
+	const bool avx512 = avx && (xcr0 & 0xe6) == 0xe6 && (leaf7[1] & 0x10000) && (leaf7[1] & 0x40000000) && (leaf7[1] & 0x80000000);
+
+	const bool bmi2 = (leaf7[1] & 0x100) != 0;
+
+	res.movbe = (leaf1[2] & 0x400000) != 0;
+
+	// MOVBE is checked on its own, the AVX-512 kernels use BZHI
+	res.level = avx512 && avx2 && bmi2 ? isa_level::avx512 : avx2 ? isa_level::avx2 : isa_level::sse2;
+
+	// Override for benchmarking, only lowers the level
+	if (const char* env = std::getenv("CHIP8_ISA"))
+	{
+		for (isa_level level : { isa_level::sse2, isa_level::avx2, isa_level::avx512 })
+		{
+			if (std::string_view(env) == isa_level_name(level) && level < res.level)
+			{
+				res.level = level;
+			}
+		}
+
+		if (res.level == isa_level::sse2)
+		{
+			res.movbe = false;
+		}
+	}
+
+	return res;
 }
 
-// Check if CPU has MOVBE instruction support
-bool has_movbe()
+const cpu_features& get_cpu_features()
 {
-	static const bool g_value = (get_cpuid(1, 0)[2] & 0x400000) != 0;
+	static const cpu_features g_value = detect_cpu_features();
 	return g_value;
 }
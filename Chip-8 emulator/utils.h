@@ -140,10 +140,25 @@ inline std::array<u32, 4> get_cpuid(u32 func, u32 subfunc)
 	return { 0u + regs[0], 0u + regs[1], 0u + regs[2], 0u + regs[3] };
 }
 
-// Check if CPU has AVX support (taken from https://github.com/RPCS3/rpcs3/blob/master/Utilities/sysinfo.cpp#L29)
-bool has_avx();
-// Check if CPU has MOVBE instruction support
-bool has_movbe();
+// Instruction set levels of the generated kernels
+enum class isa_level : u8
+{
+	sse2 = 0, // x86-64 baseline
+	avx2, // AVX2
+	avx512, // AVX-512 F/BW/VL, BMI2
+};
+
+const char* isa_level_name(isa_level level);
+
+// CPU features registry, detected once
+// The level can be capped with the CHIP8_ISA environment variable (sse2, avx2 or avx512) to compare kernel variants on the same machine
+struct cpu_features
+{
+	isa_level level;
+	bool movbe;
+};
+
+const cpu_features& get_cpu_features();
 
 // Bit scanning utils
 inline u32 cntlz32(u32 arg, bool nonzero = false)
@@ -0,0 +1,97 @@
+#pragma once
+#include "utils.h"
+
+#include <deque>
+#include <memory>
+#include <mutex>
+
+// Per-worker job queues with stealing
+// The owner takes jobs from the front of its own queue, idle workers steal from the back of others
+template <typename T>
+class work_stealing_queue
+{
+	struct alignas(64) queue_t
+	{
+		std::mutex mtx;
+		std::deque<T> items;
+	};
+
+	std::unique_ptr<queue_t[]> m_queues;
+	size_t m_count;
+
+public:
+	explicit work_stealing_queue(size_t workers)
+		: m_queues(std::make_unique<queue_t[]>(workers))
+		, m_count(workers)
+	{
+	}
+
+	size_t workers() const
+	{
+		return m_count;
+	}
+
+	// Number of jobs in the worker's queue
+	size_t size(size_t worker)
+	{
+		auto& q = m_queues[worker % m_count];
+		std::lock_guard<std::mutex> lock(q.mtx);
+		return q.items.size();
+	}
+
+	// Drop the jobs of all queues
+	void clear()
+	{
+		for (size_t i = 0; i < m_count; i++)
+		{
+			std::lock_guard<std::mutex> lock(m_queues[i].mtx);
+			m_queues[i].items.clear();
+		}
+	}
+
+	// Returns the number of jobs in the worker's queue
+	size_t push(size_t worker, T item)
+	{
+		auto& q = m_queues[worker % m_count];
+		std::lock_guard<std::mutex> lock(q.mtx);
+		q.items.emplace_back(std::move(item));
+		return q.items.size();
+	}
+
+	// Take a job from own queue or steal one, returns false when all queues are empty
+	bool pop(size_t worker, T& out)
+	{
+		{
+			auto& q = m_queues[worker];
+			std::lock_guard<std::mutex> lock(q.mtx);
+
+			if (!q.items.empty())
+			{
+				out = std::move(q.items.front());
+				q.items.pop_front();
+				return true;
+			}
+		}
+
+		return steal(worker, out);
+	}
+
+	bool steal(size_t worker, T& out)
+	{
+		// Start from the next worker to spread thieves over victims
+		for (size_t i = 1; i < m_count; i++)
+		{
+			auto& q = m_queues[(worker + i) % m_count];
+			std::lock_guard<std::mutex> lock(q.mtx);
+
+			if (!q.items.empty())
+			{
+				out = std::move(q.items.back());
+				q.items.pop_back();
+				return true;
+			}
+		}
+
+		return false;
+	}
+};